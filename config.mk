@@ -0,0 +1,14 @@
+CC = gcc
+AR = ar
+LD = $(CC)
+AS = $(CC)
+STRIP = strip
+
+CFLAGS = -Os
+LDFLAGS = 
+LIBS =
+
+bindir = /usr/bin
+sbindir = /usr/sbin
+man1dir = /usr/share/man/man1
+man8dir = /usr/share/man/man8
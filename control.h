@@ -3,6 +3,9 @@
 #define WICTL "/run/ctrl/wsupp"
 #define WICFG "/var/wipsk"
 #define WICAP "/var/wiap"
+#define WISCANS "/var/wiscans"
+#define WIHIST "/var/wihist"
+#define WILINK "/run/wilink"
 #define RESOLV_CONF "/run/resolv.conf"
 
 #define WI(c) TAGGED('W', 'I', c)
@@ -16,3 +16,12 @@ void sha1(uint8_t out[20], char* input, long inlen);
 
 /* HMAC, contiguous only */
 void hmac_sha1(uint8_t out[20], uint8_t* key, int klen, char* input, int inlen);
+
+/* HMAC with the key pads hashed in advance, for keys used repeatedly */
+struct hmac_sha1 {
+	uint32_t ih[5];
+	uint32_t oh[5];
+};
+
+void hmac_sha1_key(struct hmac_sha1* hk, uint8_t* key, int klen);
+void hmac_sha1_keyed(uint8_t out[20], struct hmac_sha1* hk, char* input, int inlen);
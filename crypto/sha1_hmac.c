@@ -23,33 +23,54 @@ static void hash_rest(struct sha1* sh, char* input, long inlen, int prev)
 	sha1_last(sh, ptr, end - ptr, inlen + prev);
 }
 
-void hmac_sha1(uint8_t out[20], uint8_t* key, int klen, char* input, int inlen)
+static void hash_pad(uint32_t H[5], uint8_t* key, int klen, uint8_t val)
 {
 	uint8_t pad[64];
 	struct sha1 sh;
-	uint8_t hash[20];
-	int hlen = sizeof(hash);
 
+	memcpy(pad, key, klen);
+	memset(pad + klen, 0, 64 - klen);
+	hmac_xor(pad, val);
+
+	sha1_init(&sh);
+	sha1_proc(&sh, (char*)pad);
+
+	memcpy(H, sh.H, sizeof(sh.H));
+}
+
+/* Both pads are exactly one block long, so the state after hashing
+   them depends on the key alone and can be reused for any input. */
+
+void hmac_sha1_key(struct hmac_sha1* hk, uint8_t* key, int klen)
+{
 	if(klen < 0)
 		klen = 0; /* wtf */
 	if(klen > 64)
 		klen = 64; /* TODO: key-hashing pass for longer keys */
 
-	memcpy(pad, key, klen);
-	memset(pad + klen, 0, 64 - klen);
-	hmac_xor(pad, 0x36);
+	hash_pad(hk->ih, key, klen, 0x36);
+	hash_pad(hk->oh, key, klen, 0x5C);
+}
 
-	sha1_init(&sh);
-	sha1_proc(&sh, (char*)pad);
-	hash_rest(&sh, input, inlen, sizeof(pad));
-	sha1_fini(&sh, hash);
+void hmac_sha1_keyed(uint8_t out[20], struct hmac_sha1* hk, char* input, int inlen)
+{
+	struct sha1 sh;
+	uint8_t hash[20];
+	int hlen = sizeof(hash);
 
-	memcpy(pad, key, klen);
-	memset(pad + klen, 0, 64 - klen);
-	hmac_xor(pad, 0x5C);
+	memcpy(sh.H, hk->ih, sizeof(sh.H));
+	hash_rest(&sh, input, inlen, 64);
+	sha1_fini(&sh, hash);
 
-	sha1_init(&sh);
-	sha1_proc(&sh, (char*)pad);
+	memcpy(sh.H, hk->oh, sizeof(sh.H));
 	sha1_last(&sh, (char*)hash, hlen, 64 + hlen);
 	sha1_fini(&sh, out);
 }
+
+void hmac_sha1(uint8_t out[20], uint8_t* key, int klen, char* input, int inlen)
+{
+	struct hmac_sha1 hk;
+
+	hmac_sha1_key(&hk, key, klen);
+	hmac_sha1_keyed(out, &hk, input, inlen);
+}
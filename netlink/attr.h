@@ -49,6 +49,7 @@ char* nl_sub_str(struct nlattr* at, uint16_t type);
 #define nl_sub_int(at, kk, tt) (tt*)(nl_sub_of_len(at, kk, sizeof(tt)))
 #define nl_sub_u32(at, kk) nl_sub_int(at, kk, uint32_t)
 #define nl_sub_i32(at, kk) nl_sub_int(at, kk, int32_t)
+#define nl_sub_u64(at, kk) nl_sub_int(at, kk, uint64_t)
 
 struct nlattr* nl_sub(struct nlattr* at, uint16_t type);
 struct nlattr* nl_sub_0(struct nlattr* at);
@@ -375,6 +375,60 @@
 #define NL80211_BSS_LAST_SEEN_BOOTTIME  15  /* u64, ns */
 #define NL80211_BSS_PAD                 16  /* pad to 64 align (?) */
 
+/* NL80211_ATTR_SCAN_FLAGS */
+#define NL80211_SCAN_FLAG_COLOCATED_6GHZ (1<<14)
+
+/* sub-attributes for NL80211_ATTR_WIPHY_BANDS entries */
+#define NL80211_BAND_ATTR_FREQS          1  /* nest */
+
+/* sub-attributes for NL80211_BAND_ATTR_FREQS entries */
+#define NL80211_FREQUENCY_ATTR_FREQ      1  /* u32, MHz */
+#define NL80211_FREQUENCY_ATTR_DISABLED  2  /* flag */
+#define NL80211_FREQUENCY_ATTR_NO_IR     3  /* flag */
+#define NL80211_FREQUENCY_ATTR_RADAR     5  /* flag */
+
+/* sub-attributes for NL80211_ATTR_SURVEY_INFO */
+#define NL80211_SURVEY_INFO_FREQUENCY    1  /* u32, MHz */
+#define NL80211_SURVEY_INFO_NOISE        2  /* u8, dBm */
+#define NL80211_SURVEY_INFO_IN_USE       3  /* flag */
+#define NL80211_SURVEY_INFO_TIME         4  /* u64, ms */
+#define NL80211_SURVEY_INFO_TIME_BUSY    5  /* u64, ms */
+
+/* sub-attributes for NL80211_ATTR_STA_INFO */
+#define NL80211_STA_INFO_STA_FLAGS  17  /* u32 mask, u32 set */
+
+/* bits in NL80211_STA_INFO_STA_FLAGS */
+#define NL80211_STA_FLAG_AUTHORIZED  1
+
+/* sub-attributes for NL80211_ATTR_CQM */
+#define NL80211_ATTR_CQM_RSSI_THOLD            1  /* s32, dBm */
+#define NL80211_ATTR_CQM_RSSI_HYST             2  /* u32, dB */
+#define NL80211_ATTR_CQM_RSSI_THRESHOLD_EVENT  3  /* u32, see below */
+#define NL80211_ATTR_CQM_PKT_LOSS_EVENT        4  /* u32, packets */
+#define NL80211_ATTR_CQM_TXE_RATE              5  /* u32 */
+#define NL80211_ATTR_CQM_TXE_PKTS              6  /* u32 */
+#define NL80211_ATTR_CQM_TXE_INTVL             7  /* u32 */
+#define NL80211_ATTR_CQM_BEACON_LOSS_EVENT     8  /* flag */
+#define NL80211_ATTR_CQM_RSSI_LEVEL            9  /* s32, dBm */
+
+/* NL80211_ATTR_CQM_RSSI_THRESHOLD_EVENT */
+#define NL80211_CQM_RSSI_THRESHOLD_EVENT_LOW   0
+#define NL80211_CQM_RSSI_THRESHOLD_EVENT_HIGH  1
+#define NL80211_CQM_RSSI_BEACON_LOSS_EVENT     2
+
 /* sub-attributes for NL80211_ATTR_KEY_DEFAULT_TYPES */
 #define NL80211_KEY_DEFAULT_TYPE_UNICAST    1
 #define NL80211_KEY_DEFAULT_TYPE_MULTICAST  2
+
+/* sub-attributes for NL80211_ATTR_REKEY_DATA */
+#define NL80211_REKEY_DATA_KEK         1
+#define NL80211_REKEY_DATA_KCK         2
+#define NL80211_REKEY_DATA_REPLAY_CTR  3
+
+/* sub-attributes for NL80211_ATTR_WOWLAN_TRIGGERS */
+#define NL80211_WOWLAN_TRIG_ANY                 1
+#define NL80211_WOWLAN_TRIG_DISCONNECT          2
+#define NL80211_WOWLAN_TRIG_MAGIC_PKT           3
+#define NL80211_WOWLAN_TRIG_PKT_PATTERN         4
+#define NL80211_WOWLAN_TRIG_GTK_REKEY_SUPPORTED 5
+#define NL80211_WOWLAN_TRIG_GTK_REKEY_FAILURE   6
@@ -38,6 +38,31 @@ static char* shift_arg(CTX)
 	return ctx->argv[ctx->argi++];
 }
 
+/* wsupp may be managing several interfaces. Commands go to the one
+   named with -i, or to the first one if there's no -i. */
+
+static void take_iface_opt(CTX)
+{
+	char* arg;
+
+	if(!(arg = shift_arg(ctx)))
+		return;
+	if(strcmp(arg, "-i")) {
+		ctx->argi--;
+		return;
+	}
+	if(!(ctx->ifname = shift_arg(ctx)))
+		fail("-i needs an interface name\n");
+}
+
+static void put_hdr(CTX, int cmd)
+{
+	uc_put_hdr(UC, cmd);
+
+	if(ctx->ifname)
+		uc_put_str(UC, ATTR_NAME, ctx->ifname);
+}
+
 void connect_wictl_check(CTX)
 {
 	if(connect_wictl_(ctx) >= 0)
@@ -52,7 +77,7 @@ static void cmd_status(CTX)
 {
 	struct ucmsg* msg;
 
-	uc_put_hdr(UC, CMD_WI_STATUS);
+	put_hdr(ctx, CMD_WI_STATUS);
 	uc_put_end(UC);
 
 	no_other_options(ctx);
@@ -74,7 +99,7 @@ static void cmd_neutral(CTX)
 	struct ucmsg* msg;
 	int ret;
 
-	uc_put_hdr(UC, CMD_WI_NEUTRAL);
+	put_hdr(ctx, CMD_WI_NEUTRAL);
 	uc_put_end(UC);
 
 	no_other_options(ctx);
@@ -97,7 +122,7 @@ static void cmd_scan(CTX)
 {
 	struct ucmsg* msg;
 
-	uc_put_hdr(UC, CMD_WI_SCAN);
+	put_hdr(ctx, CMD_WI_SCAN);
 	uc_put_end(UC);
 
 	no_other_options(ctx);
@@ -114,7 +139,7 @@ static void cmd_scan(CTX)
 			fail("net down\n");
 	}
 
-	uc_put_hdr(UC, CMD_WI_STATUS);
+	put_hdr(ctx, CMD_WI_STATUS);
 	uc_put_end(UC);
 
 	msg = send_recv_msg(ctx);
@@ -154,7 +179,7 @@ static void cmd_fixedap(CTX)
 	int slen = strlen(ssid);
 	int ret;
 
-	uc_put_hdr(UC, CMD_WI_CONNECT);
+	put_hdr(ctx, CMD_WI_CONNECT);
 	uc_put_bin(UC, ATTR_SSID, ssid, slen);
 	uc_put_end(UC);
 
@@ -166,7 +191,7 @@ static void cmd_fixedap(CTX)
 	if(ret != -ENOKEY || !ssid)
 		fail("backend error: %m\n");
 
-	uc_put_hdr(UC, CMD_WI_CONNECT);
+	put_hdr(ctx, CMD_WI_CONNECT);
 	uc_put_bin(UC, ATTR_SSID, ssid, slen);
 	put_psk_input(ctx, ssid, slen);
 	uc_put_end(UC);
@@ -181,7 +206,7 @@ static void cmd_connect(CTX)
 	if(got_any_args(ctx))
 		return cmd_fixedap(ctx);
 
-	uc_put_hdr(UC, CMD_WI_CONNECT);
+	put_hdr(ctx, CMD_WI_CONNECT);
 	uc_put_end(UC);
 
 	no_other_options(ctx);
@@ -201,7 +226,7 @@ static void cmd_forget(CTX)
 
 	slen = strlen(ssid);
 
-	uc_put_hdr(UC, CMD_WI_FORGET);
+	put_hdr(ctx, CMD_WI_FORGET);
 	uc_put_bin(UC, ATTR_SSID, ssid, slen);
 	uc_put_end(UC);
 
@@ -247,6 +272,7 @@ int main(int argc, char** argv)
 
 	init_args(ctx, argc, argv);
 	init_heap_bufs(ctx);
+	take_iface_opt(ctx);
 
 	if((cmd = shift_arg(ctx)))
 		dispatch(ctx, cmd);
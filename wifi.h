@@ -13,6 +13,7 @@ struct top {
 	char cbuf[128];
 
 	int showbss;
+	char* ifname;
 };
 
 #define CTX struct top* ctx __attribute__((unused))
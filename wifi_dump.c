@@ -13,7 +13,8 @@ typedef int (*qcmp2)(const void* a, const void* b);
    
    Ref. https://en.wikipedia.org/wiki/List_of_WLAN_channels
  
-   Bands a and b refer to 802.11a and 802.11b respectively. */
+   Bands a and b refer to 802.11a and 802.11b respectively,
+   e is for the 6GHz band (Wi-Fi 6E). */
 
 static int inrange(int freq, int a, int b, int s, int i)
 {
@@ -46,6 +47,12 @@ void get_channel(int freq, int* chan, char* band)
 	} else if((s = inrange(freq, 4915, 4980, 5, 183))) {
 		*chan = s;
 		*band = 'a';
+	} else if(freq == 5935) {
+		*chan = 2;
+		*band = 'e';
+	} else if((s = inrange(freq, 5955, 7115, 5, 1))) {
+		*chan = s;
+		*band = 'e';
 	} else {
 		*chan = 0;
 		*band = '\0';
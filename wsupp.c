@@ -3,10 +3,11 @@
 #include <sys/socket.h>
 
 #include <unistd.h>
+#include <string.h>
 #include <poll.h>
 #include <errno.h>
 #include <signal.h>
-
+#include <time.h>
 
 #include "common.h"
 #include "wsupp.h"
@@ -14,14 +15,23 @@
 const char errtag[] = "wifi";
 
 static sigset_t defsigset;
-static struct pollfd pfds[3+NCONNS];
+static struct pollfd pfds[3+NIFACES+NCONNS];
 static int npfds;
 static struct timespec pollts;
-static int timerset;
+static int exiting;
+
+/* One process handles all the interfaces. The netlink socket, the control
+   socket, /dev/rfkill and the event loop are shared, and so are the PSK
+   config, the ESS table, and the per-BSSID history and failure records.
+   Each interface only costs its struct iface and its scan slots. */
+
+struct iface ifaces[NIFACES];
+struct iface* ifc;
+int nifaces;
 
-int opermode;
 int pollset;
 int sigterm;
+int sighup;
 int done;
 
 static void sighandler(int sig)
@@ -30,6 +40,9 @@ static void sighandler(int sig)
 		case SIGCHLD:
 			reap_dhcp();
 			break;
+		case SIGHUP:
+			sighup = 1;
+			break;
 		case SIGINT:
 		case SIGTERM: sigterm = 1;
 	}
@@ -116,8 +129,8 @@ static void check_rawsock(struct pollfd* pf)
 	if(!(pf->revents & ~POLLIN))
 		return;
 
-	close(rawsock);
-	rawsock = -1;
+	close(ifc->rawsock);
+	ifc->rawsock = -1;
 	pf->fd = -1;
 }
 
@@ -136,12 +149,13 @@ static void check_rfkill(struct pollfd* pf)
 static void update_pollfds(void)
 {
 	set_pollfd(&pfds[0], netlink);
-	set_pollfd(&pfds[1], rawsock);
-	set_pollfd(&pfds[2], ctrlfd);
-	set_pollfd(&pfds[3], rfkill);
+	set_pollfd(&pfds[1], ctrlfd);
+	set_pollfd(&pfds[2], rfkill);
 
-	int i, n = 4;
+	int i, n = 3 + nifaces;
 
+	for(i = 0; i < nifaces; i++)
+		set_pollfd(&pfds[3+i], ifaces[i].rawsock);
 	for(i = 0; i < nconns; i++)
 		set_pollfd(&pfds[n+i], conns[i].fd);
 
@@ -151,113 +165,420 @@ static void update_pollfds(void)
 
 static void check_polled_fds(void)
 {
-	int i, n = 4;
+	int i, n = 3 + nifaces;
 
 	for(i = 0; i < nconns; i++)
 		check_conn(&pfds[n+i], &conns[i]);
 
 	check_netlink(&pfds[0]);
-	check_rawsock(&pfds[1]);
-	check_control(&pfds[2]);
-	check_rfkill(&pfds[3]);
+
+	for(i = 0; i < nifaces; i++) {
+		ifc = &ifaces[i];
+		check_rawsock(&pfds[3+i]);
+	}
+
+	check_control(&pfds[1]);
+	check_rfkill(&pfds[2]);
+}
+
+/* CLOCK_BOOTTIME keeps running while the host is suspended,
+   so anything stamped with it ages properly across suspend. */
+
+int uptime(void)
+{
+	struct timespec ts;
+
+	if(clock_gettime(CLOCK_BOOTTIME, &ts) < 0)
+		quit("clock_gettime: %m\n");
+
+	return ts.tv_sec;
+}
+
+/* Same clock, for things that take less than a second. */
+
+uint64_t uptime_ms(void)
+{
+	struct timespec ts;
+
+	if(clock_gettime(CLOCK_BOOTTIME, &ts) < 0)
+		quit("clock_gettime: %m\n");
+
+	return ts.tv_sec*1000ULL + ts.tv_nsec/1000000;
+}
+
+/* Wall clock time, for the timestamps that get saved to disk
+   and must make sense after a reboot. */
+
+uint64_t wallclock(void)
+{
+	struct timespec ts;
+
+	if(clock_gettime(CLOCK_REALTIME, &ts) < 0)
+		return 0;
+
+	return ts.tv_sec;
+}
+
+/* CLOCK_MONOTONIC stops while the host is suspended, CLOCK_BOOTTIME
+   does not, so the gap between the two grows with each suspend. */
+
+#define RESUME_GAP 1000 /* ms */
+
+static int64_t suspgap;
+
+static int64_t suspended_ms(void)
+{
+	struct timespec bt, mt;
+
+	if(clock_gettime(CLOCK_BOOTTIME, &bt) < 0)
+		return suspgap;
+	if(clock_gettime(CLOCK_MONOTONIC, &mt) < 0)
+		return suspgap;
+
+	return (bt.tv_sec - mt.tv_sec)*1000LL + (bt.tv_nsec - mt.tv_nsec)/1000000;
 }
 
+static void check_resume(void)
+{
+	int64_t gap = suspended_ms();
+
+	if(gap - suspgap > RESUME_GAP)
+		for(ifc = ifaces; ifc < ifaces + nifaces; ifc++)
+			if(ifc->opermode != OP_EXIT)
+				handle_resume();
+
+	suspgap = gap;
+}
+
+/* There are two timers. The regular one drives routine scans and
+   guards against anything getting stuck for too long. The deadline
+   is for the individual steps of a connection attempt, which take
+   milliseconds when things go well, see handle_deadline().
+
+   Each interface has its own pair. Whenever a regular timer fires,
+   those of the other interfaces coming due within TIMER_SLACK get
+   handled in the same wakeup, so that more interfaces do not mean
+   proportionally more wakeups. Routine scan periods are long enough
+   not to care. Short timers may be waiting for something specific,
+   like rfkill after the link going down, and stay exact, and so do
+   the deadlines. */
+
+#define TIMER_SLACK 1000 /* ms */
+#define SLACK_MIN   10   /* s, shorter timers are exact */
+
 void clr_timer(void)
 {
-	pollts.tv_sec = 0;
-	pollts.tv_nsec = 0;
-	timerset = 0;
+	ifc->timerdue = 0;
 }
 
 void set_timer(int seconds)
 {
-	pollts.tv_sec = seconds;
-	pollts.tv_nsec = 0;
-	timerset = 1;
+	ifc->timerdue = uptime_ms() + 1000ULL*seconds;
+	ifc->timerslack = (seconds >= SLACK_MIN) ? TIMER_SLACK : 0;
+}
+
+void clr_deadline(void)
+{
+	ifc->deadline = 0;
+}
+
+void set_deadline(int ms)
+{
+	ifc->deadline = uptime_ms() + ms;
+}
+
+static struct timespec* poll_timeout(void)
+{
+	uint64_t now = uptime_ms();
+	uint64_t due = 0;
+
+	for(ifc = ifaces; ifc < ifaces + nifaces; ifc++) {
+		if(ifc->opermode == OP_EXIT)
+			continue;
+		if(ifc->timerdue && (!due || ifc->timerdue < due))
+			due = ifc->timerdue;
+		if(ifc->deadline && (!due || ifc->deadline < due))
+			due = ifc->deadline;
+	}
+
+	if(!due)
+		return NULL;
+
+	due = (due > now) ? due - now : 0;
+
+	pollts.tv_sec = due / 1000;
+	pollts.tv_nsec = (due % 1000) * 1000000;
+
+	return &pollts;
 }
 
 static void timer_expired(void)
 {
 	clr_timer();
 
-	if(authstate == AS_NETDOWN) {
-		if(!rfkilled)
-			opermode = OP_EXIT;
+	if(ifc->authstate == AS_NETDOWN) {
+		if(!ifc->rfkilled)
+			ifc->opermode = OP_EXIT;
 		else
-			authstate = AS_IDLE;
+			ifc->authstate = AS_IDLE;
 		return;
 	}
 
-	if(authstate == AS_CONNECTED)
+	if(ifc->authstate == AS_CONNECTED)
 		routine_bg_scan();
-	else if(authstate != AS_IDLE)
+	else if(ifc->authstate != AS_IDLE)
 		abort_connection();
 	else
 		routine_fg_scan();
 }
 
-static void xshutdown(void)
+static void check_timers(void)
 {
-	sigterm = 0;
-
-	switch(opermode) {
-		case OP_EXIT:
-		case OP_EXITREQ:
-			quit("second exit request\n");
+	uint64_t now = uptime_ms();
+	int firing = 0;
+
+	for(ifc = ifaces; ifc < ifaces + nifaces; ifc++) {
+		if(ifc->opermode == OP_EXIT)
+			continue;
+		if(ifc->deadline && ifc->deadline <= now) {
+			clr_deadline();
+			handle_deadline();
+		}
+		if(ifc->timerdue && ifc->timerdue <= now)
+			firing = 1;
 	}
-	switch(authstate) {
+
+	if(!firing)
+		return;
+
+	for(ifc = ifaces; ifc < ifaces + nifaces; ifc++)
+		if(ifc->opermode == OP_EXIT)
+			continue;
+		else if(ifc->timerdue && ifc->timerdue <= now + ifc->timerslack)
+			timer_expired();
+}
+
+static void stop_iface(void)
+{
+	switch(ifc->authstate) {
 		case AS_IDLE:
 		case AS_NETDOWN:
-			opermode = OP_EXIT;
+			ifc->opermode = OP_EXIT;
 			return;
 	}
 
 	if(start_disconnect() < 0)
-		opermode = OP_EXIT;
+		ifc->opermode = OP_EXIT;
 	else
-		opermode = OP_EXITREQ;
+		ifc->opermode = OP_EXITREQ;
+}
+
+static void xshutdown(void)
+{
+	sigterm = 0;
+
+	if(exiting)
+		quit("second exit request\n");
+
+	exiting = 1;
+
+	for(ifc = ifaces; ifc < ifaces + nifaces; ifc++)
+		stop_iface();
+}
+
+/* Exit without dropping the links, for the next instance to pick up,
+   see wsupp_link.c. Anything short of a fully set up link gets
+   the regular shutdown. */
+
+static void keep_iface(void)
+{
+	if(ifc->authstate != AS_CONNECTED || ifc->eapolstate != ES_NEGOTIATED)
+		return stop_iface();
+	if(save_link_state() < 0)
+		return stop_iface();
+
+	ifc->opermode = OP_EXIT;
+	ifc->keeplink = 1;
+}
+
+static void xrestart(void)
+{
+	sighup = 0;
+
+	if(exiting)
+		quit("second exit request\n");
+
+	exiting = 1;
+
+	for(ifc = ifaces; ifc < ifaces + nifaces; ifc++)
+		keep_iface();
+}
+
+static int running(void)
+{
+	for(ifc = ifaces; ifc < ifaces + nifaces; ifc++)
+		if(ifc->opermode != OP_EXIT)
+			return 1;
+
+	return 0;
+}
+
+/* Notifications get routed by ifindex, so each interface may only
+   appear once, either managed or as the scan helper of a single
+   managed one. */
+
+static void check_clash(struct iface* fi, int ifi, char* name)
+{
+	if(fi->ifindex == ifi || fi->scanifi == ifi)
+		fail("%s given more than once\n", name);
+}
+
+/* Roaming tunables may precede the interface names, -H dB for the
+   hysteresis and -D seconds for the minimum dwell time. */
+
+static int parse_value(char* opt, char* arg)
+{
+	char* p;
+	int val = 0;
+
+	if(!arg || !*arg)
+		fail("%s needs a value\n", opt);
+
+	for(p = arg; *p; p++)
+		if(*p < '0' || *p > '9' || val > 100000)
+			fail("bad value for %s: %s\n", opt, arg);
+		else
+			val = 10*val + (*p - '0');
+
+	return val;
+}
+
+static int take_options(int argc, char** argv)
+{
+	int i, val;
+	char* opt;
+
+	for(i = 1; i < argc && argv[i][0] == '-'; i += 2) {
+		opt = argv[i];
+		val = parse_value(opt, argv[i+1]);
+
+		if(!strcmp(opt, "-H"))
+			roamhyst = 100*val;
+		else if(!strcmp(opt, "-D"))
+			roamdwell = val;
+		else
+			fail("unknown option %s\n", opt);
+	}
+
+	return i;
+}
+
+/* Arguments are interface names, each optionally followed by the name
+   of its scan helper, wlan0:wlan1. Colons are not allowed in interface
+   names, so there is no ambiguity. */
+
+static void add_iface(char* name)
+{
+	struct iface* fi;
+	char* scan;
+
+	if(nifaces >= NIFACES)
+		fail("too many interfaces\n");
+
+	ifc = &ifaces[nifaces++];
+
+	if((scan = strchr(name, ':')))
+		*scan++ = '\0';
+
+	setup_iface(name);
+
+	if(scan)
+		setup_scan_iface(scan);
+
+	for(fi = ifaces; fi < ifc; fi++) {
+		check_clash(fi, ifc->ifindex, name);
+
+		if(ifc->scanifi)
+			check_clash(fi, ifc->scanifi, scan);
+	}
 }
 
 int main(int argc, char** argv)
 {
-	int i = 1, ret;
-	char* name;
+	int adopted[NIFACES];
+	int i, ret;
 
-	if(i < argc)
-		name = argv[i++];
-	else
+	if((i = take_options(argc, argv)) >= argc)
 		fail("too few arguments\n");
-	if(i < argc)
-		fail("too many arguments\n");
 
 	setup_signals();
 	setup_netlink();
-	setup_iface(name);
+
+	for(; i < argc; i++)
+		add_iface(argv[i]);
+
+	setup_nlfilter();
+
+	for(ifc = ifaces; ifc < ifaces + nifaces; ifc++) {
+		setup_chans();
+		setup_frames();
+		setup_wowlan();
+	}
+
 	setup_control();
 	retry_rfkill();
+	load_history();
 
-	opermode = OP_NEUTRAL;
-	load_state();
-	routine_fg_scan();
+	for(ifc = ifaces; ifc < ifaces + nifaces; ifc++) {
+		ifc->opermode = OP_NEUTRAL;
+		load_state();
+		load_scan_state();
+
+		adopted[ifc - ifaces] = (adopt_link() >= 0);
+	}
+
+	for(ifc = ifaces; ifc < ifaces + nifaces; ifc++)
+		if(adopted[ifc - ifaces])
+			resume_link();
+		else
+			startup_scan();
 
-	while(opermode) {
-		struct timespec* ts = timerset ? &pollts : NULL;
+	suspgap = suspended_ms();
+
+	while(running()) {
+		struct timespec* ts = poll_timeout();
 
 		if(!pollset)
 			update_pollfds();
 		if((ret = ppoll(pfds, npfds, ts, &defsigset)) > 0)
 			check_polled_fds();
-		else if(ret == 0)
-			timer_expired();
-		else if(errno != EINTR)
+		else if(ret < 0 && errno != EINTR)
 			quit("ppoll: %m\n");
+
+		check_resume();
+		check_timers();
+
 		if(sigterm)
 			xshutdown();
+		else if(sighup)
+			xrestart();
 
 		save_config();
+		sync_history();
+
+		for(ifc = ifaces; ifc < ifaces + nifaces; ifc++)
+			sync_scan_state();
+	}
+
+	for(ifc = ifaces; ifc < ifaces + nifaces; ifc++) {
+		if(!ifc->keeplink)
+			clear_wowlan();
+
+		save_state();
+		save_scan_state();
 	}
 
-	save_state();
+	save_history();
 	unlink_control();
 
 	return 0;
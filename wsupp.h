@@ -1,10 +1,19 @@
 #include "common.h"
+#include "crypto/sha1.h"
 
 #define SSIDLEN 32
 #define NCONNS 10
-#define NSCANS 30
+#define NSCANS 512
+#define NCHANS 128
+#define NIFACES 8
+#define NESSES (NIFACES*(NSCANS+1)+1) /* slot 0, scans and current AP */
+#define NNONCES 4
+#define NNEIGHS 16
+#define HASHSIZE 1024 /* power of 2, at least 2*NSCANS */
+#define ESSHASH 16384 /* power of 2, at least 2*NESSES */
 
 #define MACLEN 6
+#define PATHLEN 64
 
 /* authstate */
 #define AS_IDLE            0
@@ -27,6 +36,7 @@
 #define SS_IDLE            0
 #define SS_SCANNING        1
 #define SS_SCANDUMP        2
+#define SS_SURVEYDUMP      3
 
 /* opermode */
 #define OP_EXIT            0
@@ -45,12 +55,25 @@
 #define ST_RSN_P_CCMP  (1<<6)
 #define ST_RSN_G_TKIP  (1<<7) /* group */
 #define ST_RSN_G_CCMP  (1<<8)
+#define ST_RRM_NEIGHBORS (1<<9) /* 802.11k neighbor reports */
+
+/* scan.phy */
+#define PHY_LEGACY     0
+#define PHY_HT         1 /* 802.11n */
+#define PHY_VHT        2 /* 802.11ac */
+#define PHY_HE         3 /* 802.11ax */
+
+/* scan.bw */
+#define BW_20          0
+#define BW_40          1
+#define BW_80          2
+#define BW_160         3
 
 #define SF_SEEN        (1<<0)
 #define SF_GOOD        (1<<1)
-#define SF_PASS        (1<<2)
-#define SF_STALE       (1<<3)
+#define SF_STALE       (1<<3) /* missed by recent scans */
 #define SF_TRIED       (1<<4)
+#define SF_DIRTY       (1<<5) /* needs re-ranking */
 
 struct scan {
 	short freq;
@@ -58,41 +81,56 @@ struct scan {
 	short flags;
 	short type;
 	uint8_t bssid[6];
+	short ess; /* index into esses[] */
+	int seen; /* uptime() */
+	uint ielen;
+	uint32_t iehash;
+	byte phy;
+	byte bw;
+	byte nss;
+	byte load; /* BSS Load channel utilization, 0..255 */
+	int tput;  /* estimated throughput, 100kbps units */
+	int score; /* tput adjusted by connection history */
+};
+
+/* ess.flags */
+#define EF_PASS        (1<<0)
+#define EF_CHECKED     (1<<1)
+
+struct ess {
+	short refs;
+	short flags;
 	ushort slen;
 	uint8_t ssid[SSIDLEN];
 };
 
+/* chan.flags */
+#define CF_RADAR       (1<<0)
+#define CF_SCANNED     (1<<1)
+#define CF_RNR         (1<<2)
+
+struct chan {
+	short freq;
+	short flags;
+	int scanned; /* uptime() */
+	int busy;    /* survey busy time, 0..255 */
+};
+
 struct conn {
 	int fd;
 	int rep;
+	int ifi; /* interface the reports come from */
 };
 
-extern char* ifname;
-extern int ifindex;
-
-extern int ctrlfd;    /* control socket */
-extern int rfkill;    /* fd, /dev/rfkill */
-extern int rawsock;   /* fd, EAPOL socket */
-extern int netlink;   /* fd, GENL */
-
-extern struct scan scans[];
-extern struct conn conns[];
-extern int nscans;
-extern int nconns;
-
-extern int opermode;
-extern int scanstate;
-extern int authstate;
-extern int rfkilled;
-
 /* The AP we're tuned on */
 
-extern struct ap {
+struct ap {
 	byte bssid[6];
 	short freq;
 	short signal;
 	ushort slen;
 	short type;
+	short ess;
 	uint8_t ssid[SSIDLEN];
 	const void* ies;
 	uint iesize;
@@ -103,7 +141,129 @@ extern struct ap {
 
 	int success;
 	int rescans;
-} ap;
+};
+
+struct neigh {
+	byte bssid[6];
+	short freq;
+	int pref;
+};
+
+/* Everything that belongs to a single managed interface. The code works
+   on one interface at a time, the one ifc points to, and the main loop
+   or the netlink code switch it before handling any event. The netlink
+   and control sockets, the PSK config, the ESS table and the per-BSSID
+   records are shared, see wsupp.c. */
+
+extern struct iface {
+	char* ifname;
+	int ifindex;
+	int rawsock;  /* fd, EAPOL socket */
+	int scanifi;  /* helper interface, see scan_iface() */
+
+	int opermode;
+	int scanstate;
+	int lastscan;
+	int authstate;
+	int eapolstate;
+	int rfkilled;
+	int rfkidx;
+	int keeplink; /* exiting without disconnect */
+
+	uint64_t timerdue; /* uptime_ms() */
+	int timerslack;    /* ms, see check_timers() */
+	uint64_t deadline; /* uptime_ms() */
+
+	struct ap ap;
+
+	/* wsupp_slots.c */
+	struct scan* scans;
+	int nscans;
+	int maxscans;
+	int scansize;
+	ushort scanhash[HASHSIZE]; /* slot index + 1, 0 for empty */
+	ushort freescans[NSCANS];
+	int nfree;
+
+	/* wsupp_chans.c */
+	struct chan chans[NCHANS];
+	int nchans;
+	int got6ghz;
+
+	/* wsupp_apsel.c */
+	ushort heap[NSCANS];   /* scan slot indices */
+	short heappos[NSCANS]; /* position in heap + 1, 0 if not there */
+	int heapsize;
+	int rankstale;
+	int rankexpiry;
+	int cacheonly;
+	int roaming;
+	int connectedat; /* uptime() */
+	int roamscan;    /* uptime() */
+	int steered;     /* BTM request pending a scan */
+
+	/* wsupp_netlink.c */
+	int scanreq;
+	uint scanseq;
+	int scanchunk;
+	int scanon;   /* interface the current scan runs on */
+	int scanqueue; /* requests held back by a harvest dump */
+	int nosurvey;
+	uint cqmseq;
+	uint frameseq;
+	uint rekeyseq;
+	int norekey;
+	byte prevbssid[6];
+
+	/* wsupp_eapol.c, see definitions for these */
+	byte PSK[32];
+	struct hmac_sha1 pskhmac;
+	byte nonces[NNONCES][32];
+	int nnonces;
+	byte amac[6]; /* == ap.bssid */
+	byte smac[6];
+	byte anonce[32];
+	byte snonce[32];
+	byte replay[8];
+	int version;
+	int eapolsends;
+	byte KCK[16];
+	byte KEK[16];
+	byte PTK[16];
+	byte GTK[32];
+	byte RSC[6];
+	int gtkindex;
+
+	/* wsupp_neigh.c */
+	struct neigh neighs[NNEIGHS];
+	int nneighs;
+	int registered;
+	byte token;
+
+	/* wsupp_hist.c */
+	uint64_t attempt; /* uptime_ms() */
+	int connected;    /* uptime() */
+
+	/* wsupp_state.c */
+	int savedscan;
+	int savedtime;
+
+	int dhcpid;
+} ifaces[], *ifc;
+
+extern int nifaces;
+
+extern int ctrlfd;    /* control socket */
+extern int rfkill;    /* fd, /dev/rfkill */
+extern int netlink;   /* fd, GENL */
+
+extern struct ess esses[];
+extern struct conn conns[];
+extern int nesses;
+extern int nconns;
+
+extern int roamhyst;  /* mBm */
+extern int roamdwell; /* seconds */
 
 /* Config file parsing */
 
@@ -117,25 +277,28 @@ struct chunk {
 	char* end;
 };
 
-/* Encryption parameters */
-
-extern byte PSK[32];
-extern byte amac[6]; /* == ap.bssid */
-extern byte smac[6];
-/* see definitions for these */
-extern byte KCK[16];
-extern byte KEK[16];
-extern byte PTK[16];
-extern byte GTK[32];
-extern byte RSC[6];
-extern int gtkindex;
+/* Negotiated EAPOL state, carried over hitless restarts */
+
+struct eapolctx {
+	byte kck[16];
+	byte kek[16];
+	byte replay[8];
+	int gtkindex;
+	int version;
+};
+
 extern int pollset;
 
 void setup_netlink(void);
+void setup_nlfilter(void);
 void setup_iface(char* name);
+void setup_scan_iface(char* name);
+void setup_chans(void);
+void setup_wowlan(void);
+void clear_wowlan(void);
 void setup_control(void);
 void unlink_control(void);
-void reopen_rawsock(void);
+int reopen_rawsock(void);
 
 void handle_netlink(void);
 void handle_rawsock(void);
@@ -146,35 +309,104 @@ void retry_rfkill(void);
 
 void upload_ptk(void);
 void upload_gtk(void);
+void upload_rekey_data(void);
+void sync_rekey_state(byte ctr[8]);
 void prime_eapol_state(void);
 void allow_eapol_sends(void);
 void reset_eapol_state(void);
+void prewarm_eapol(void);
+void wipe_psk(void);
+void stash_eapol_state(struct eapolctx* ec);
+void adopt_eapol_state(struct eapolctx* ec);
 int start_full_scan(void);
 int start_void_scan(void);
 int start_scan(int freq);
+int start_roam_scan(void);
+int dump_cached_scan(void);
 int start_disconnect(void);
 int start_connection(void);
+int start_roaming(byte prev[6]);
+int send_action_frame(void* buf, int len);
+void adopt_association(void);
 
 #define PF __attribute__((format(printf,1,2)))
 
 void quit(const char* fmt, ...) PF noreturn;
 void quitx(const char* fmt, ...) PF noreturn;
+void drop_iface(const char* fmt, ...) PF;
 void abort_connection(void);
 
 struct scan* grab_scan_slot(byte bssid[6]);
 struct conn* grab_conn_slot(void);
 void free_scan_slot(struct scan* sc);
+void share_scan(struct scan* sc);
 
 void parse_station_ies(struct scan* sc, char* buf, uint len);
 struct scan* find_scan_slot(byte bssid[6]);
 
+int find_ess(byte* ssid, int slen);
+int grab_ess(byte* ssid, int slen);
+void drop_ess(int id);
+
+void reset_scan_chunks(void);
+int fill_scan_chunk(int stage, int* freqs, int max);
+void mark_rnr_channel(int freq);
+void mark_scanned_freq(int freq, int when);
+int scan_is_stale(struct scan* sc);
+void set_channel_busy(int freq, int busy);
+int channel_busy(int freq);
+int scan_colocated_6ghz(void);
+int chan_usable(int freq);
+
+void setup_frames(void);
+int fill_assoc_ies(char* buf, int max);
+void request_neighbors(void);
+void clear_neighbors(void);
+int neighbor_pref(byte bssid[6]);
+int fill_neighbor_freqs(int* freqs, int max);
+void handle_action_frame(byte* buf, int len);
+
+void note_failure(byte bssid[6], int phase);
+void clear_failures(byte bssid[6]);
+int backoff_until(byte bssid[6]);
+
+void hist_attempt(void);
+void hist_failure(byte bssid[6]);
+void hist_connected(byte bssid[6], int signal);
+void hist_adopted(byte bssid[6]);
+void hist_signal(byte bssid[6], int signal);
+void hist_disconnected(byte bssid[6], int reason, int byap);
+int hist_score(byte bssid[6]);
+void load_history(void);
+void save_history(void);
+void sync_history(void);
+
 void reconnect_to_current_ap(void);
 void reassess_wifi_situation(void);
 void handle_connect(void);
+void consider_roaming(void);
+int is_roaming(void);
+void handle_weak_signal(void);
+void handle_beacon_loss(void);
+struct scan* find_transition_target(void);
+void start_transition(struct scan* sc);
+void start_transition_scan(void);
 void handle_disconnect(void);
 void handle_rfrestored(void);
+void handle_channel_switch(int freq);
+void handle_resume(void);
+int adopt_current_ap(struct scan* sc);
 void check_new_scan_results(void);
+void unrank_scan(struct scan* sc);
+void invalidate_ranking(void);
+void invalidate_rankings(void);
+void rerank_bssid(byte bssid[6]);
+void handle_harvested_scan(void);
+void handle_shared_scan(void);
+void handle_cached_scan(void);
 int run_stamped_scan(void);
+int known_ap_freq(int freq);
+int got_good_enough_ap(void);
 
 int load_config(void);
 void save_config(void);
@@ -183,6 +415,16 @@ void drop_config(void);
 void load_state(void);
 void save_state(void);
 
+void iface_path(char* buf, int size, char* base, char* suffix);
+int commit_tmp(int fd, char* tmp, char* path, int ret);
+void load_scan_state(void);
+void save_scan_state(void);
+void sync_scan_state(void);
+
+int save_link_state(void);
+int adopt_link(void);
+void resume_link(void);
+
 int got_psk_for(byte* ssid, int slen);
 int load_psk(byte* ssid, int slen, byte psk[32]);
 void save_psk(byte* ssid, int slen, byte psk[32]);
@@ -190,6 +432,12 @@ int drop_psk(byte* ssid, int slen);
 
 void set_timer(int seconds);
 void clr_timer(void);
+void set_deadline(int ms);
+void clr_deadline(void);
+void handle_deadline(void);
+int uptime(void);
+uint64_t uptime_ms(void);
+uint64_t wallclock(void);
 
 void reset_station(void);
 int set_fixed_saved(byte* ssid, int slen);
@@ -207,6 +455,7 @@ void trigger_dhcp(void);
 void kill_dhcp(void);
 void reap_dhcp(void);
 
+void startup_scan(void);
 void routine_fg_scan(void);
 void routine_bg_scan(void);
 int maybe_start_scan(void);
@@ -9,6 +9,24 @@
 
 #define TIME_TO_FG_SCAN 1*60
 #define TIME_TO_BG_SCAN 5*60
+#define TIME_TO_RESCAN  10
+
+/* Chunked scans stop once there's an AP at least this strong. */
+
+#define GOOD_ENOUGH_SIGNAL -6500 /* -65dBm */
+
+/* Roaming between APs of the same ESS, see consider_roaming().
+   Hysteresis and dwell time may be changed from the command line. */
+
+#define ROAM_MIN_DWELL  30
+#define ROAM_THRESHOLD  -6500 /* -65dBm */
+#define ROAM_HYSTERESIS 800   /* 8dB */
+#define ROAM_TIMEOUT    10
+#define ROAM_SCAN_INTERVAL 10
+
+int roamhyst = ROAM_HYSTERESIS;
+int roamdwell = ROAM_MIN_DWELL;
+
 
 /* IEs (Information Elements) telling the AP which cipher we'd like to use
    must be sent twice: first in ASSOCIATE request, and then also in EAPOL
@@ -54,46 +72,111 @@ static int check_wpa(struct scan* sc)
 	return 1;
 }
 
+static int got_pass(struct scan* sc)
+{
+	return (esses[sc->ess].flags & EF_PASS);
+}
+
 static int connectable(struct scan* sc)
 {
 	if(!(sc->flags & SF_GOOD))
 		return 0; /* bad crypto */
 	if(sc->flags & SF_TRIED)
 		return 0; /* already tried that */
-	if(ap.fixed)
+	if(ifc->ap.fixed)
 		return 1;
-	if(!(sc->flags & SF_PASS))
+	if(!got_pass(sc))
 		return 0;
 	return 1;
 }
 
 static int match_ssid(struct scan* sc)
 {
-	if(!ap.fixed)
+	if(!ifc->ap.fixed)
 		return 1;
-	if(sc->slen != ap.slen)
-		return 0;
-	if(memcmp(sc->ssid, ap.ssid, ap.slen))
-		return 0;
-	return 1;
+
+	return (sc->ess && sc->ess == ifc->ap.ess);
 }
 
-/* Impose slight preference for the 5GHz band. Only matters if there are
-   several connectable APs (which is rare in itself) in different bands.
+/* APs get ranked by expected throughput, estimated from what the AP
+   advertises in its IEs, the signal level, and how busy the channel is.
+   The idea is to land on an idle 80MHz 5GHz AP rather than on the
+   loudest one, which is often a congested 2.4GHz AP.
+
+   The estimate is rough. The SNR is taken against a fixed noise floor
+   that goes up 3dB with each doubling of channel width, the best MCS
+   for that SNR is picked off the table below, and the rate gets scaled
+   by the number of spatial streams, the channel width, and the fraction
+   of airtime that is not already taken. We do not know how many streams
+   the card has, but most clients have 2.
+
+   Ref. IEEE 802.11-2020 Table 19-27, Table 21-30 (MCS rates) */
+
+#define NOISE_FLOOR -95 /* dBm, 20MHz */
+#define CLIENT_NSS 2
+
+static const struct mcs {
+	char snr;   /* dB */
+	short rate; /* 20MHz, 1 stream, 800ns GI, 100kbps units */
+} mcstable[] = {
+	{  2,   65 }, {  5,  130 }, {  9,  195 }, { 11,  260 },
+	{ 15,  390 }, { 18,  520 }, { 20,  585 }, { 25,  650 }, /* HT */
+	{ 29,  780 }, { 31,  867 },                             /* VHT */
+	{ 34,  975 }, { 37, 1083 }                              /* HE */
+};
+
+static const char maxmcs[] = {
+	[PHY_LEGACY] = 7,
+	[PHY_HT] = 7,
+	[PHY_VHT] = 9,
+	[PHY_HE] = 11
+};
 
-   Signal limit is set to avoid picking weak 5GHz APs over strong 2GHz ones.
-   The number is arbitrary and shouldn't matter much as long as it's high
-   enough to not interfere with nearby APs.
+/* Data subcarriers relative to 20MHz, in percent */
 
-   Hard-coded; making it controllable takes way more code than it's worth. */
+static const short bwscale[] = {
+	[BW_20] = 100,
+	[BW_40] = 208,
+	[BW_80] = 450,
+	[BW_160] = 900
+};
 
-static int band_score(struct scan* sc)
+static int mcs_rate(struct scan* sc)
 {
-	if(sc->signal < -7500) /* -75dBm */
-		return 0;
-	if(sc->freq / 1000 == 5) /* 5GHz */
-		return 1;
-	return 0;
+	int bw = sc->bw & 3;
+	int phy = sc->phy & 3;
+	int snr = sc->signal/100 - (NOISE_FLOOR + 3*bw);
+	int i, rate = 0;
+
+	for(i = 0; i <= maxmcs[phy]; i++)
+		if(snr >= mcstable[i].snr)
+			rate = mcstable[i].rate;
+
+	if(phy == PHY_LEGACY)
+		rate = rate*54/65;
+	else if(phy == PHY_HE)
+		rate = rate*12/10; /* 4x symbols, shorter GI */
+
+	return rate;
+}
+
+static int estimate_throughput(struct scan* sc)
+{
+	int nss = sc->nss ? sc->nss : 1;
+	int bw = sc->bw & 3;
+	int busy = channel_busy(sc->freq);
+	int load = sc->load > busy ? sc->load : busy;
+	int rate;
+
+	if(nss > CLIENT_NSS)
+		nss = CLIENT_NSS;
+
+	rate = mcs_rate(sc)*nss*bwscale[bw]/100;
+
+	if(load > 230)
+		load = 230; /* always get some share */
+
+	return rate*(255 - load)/255;
 }
 
 static int cmp(int a, int b)
@@ -105,13 +188,20 @@ static int cmp(int a, int b)
 	return 0;
 }
 
+static int fresh(struct scan* sc)
+{
+	return !(sc->flags & SF_STALE);
+}
+
 static int compare(struct scan* sc, struct scan* best)
 {
 	int r;
 
 	if(!best)
 		return 1;
-	if((r = cmp(band_score(sc), band_score(best))))
+	if((r = cmp(fresh(sc), fresh(best))))
+		return r;
+	if((r = cmp(sc->score, best->score)))
 		return r;
 	if((r = cmp(sc->signal, best->signal)))
 		return r;
@@ -119,46 +209,279 @@ static int compare(struct scan* sc, struct scan* best)
 	return 0;
 }
 
-/* We never sort the scanlist, we just pick the best non-marked AP,
-   mark it and try to connect until there's no more APs left. */
+/* Connectable APs are kept in a binary heap ordered by compare(),
+   so that picking the best one, marking it and picking the next one
+   after a failed attempt does not mean going through the whole scan
+   list each time. Entries get re-ranked individually as their signal
+   or flags change. Scan dumps overwrite the keys of many entries before
+   any of them gets re-ranked, so those get taken out of the heap first
+   and put back in check_new_scan_results().
 
-static struct scan* get_best_ap(void)
+   Whether an AP is connectable also depends on ap.fixed, ap.ess and
+   the PSKs we have. Those change rarely, and when they do the whole
+   heap gets rescored and rebuilt on the next get_best_ap() call.
+   The scores also depend on connection history (see wsupp_hist.c),
+   but that changes one BSSID at a time, see rerank_bssid(). */
+
+
+/* Backed off APs need to be re-ranked once the backoff expires,
+   so the earliest expiry gets tracked here. */
+
+static int backed_off(struct scan* sc)
+{
+	int until = backoff_until(sc->bssid);
+
+	if(!until)
+		return 0;
+	if(!ifc->rankexpiry || until < ifc->rankexpiry)
+		ifc->rankexpiry = until;
+
+	return 1;
+}
+
+static int candidate(struct scan* sc)
+{
+	if(!sc->freq)
+		return 0;
+	if(!connectable(sc))
+		return 0;
+	if(!match_ssid(sc))
+		return 0;
+	if(backed_off(sc))
+		return 0;
+
+	return 1;
+}
+
+static int heap_better(int i, int j)
+{
+	struct scan* a = ifc->scans + ifc->heap[i];
+	struct scan* b = ifc->scans + ifc->heap[j];
+
+	return compare(a, b) > 0;
+}
+
+static void heap_swap(int i, int j)
+{
+	ushort t = ifc->heap[i];
+
+	ifc->heap[i] = ifc->heap[j];
+	ifc->heap[j] = t;
+
+	ifc->heappos[ifc->heap[i]] = i + 1;
+	ifc->heappos[ifc->heap[j]] = j + 1;
+}
+
+static void sift_up(int i)
+{
+	int p;
+
+	for(; i > 0; i = p) {
+		p = (i - 1)/2;
+
+		if(!heap_better(i, p))
+			break;
+
+		heap_swap(i, p);
+	}
+}
+
+static void sift_down(int i)
+{
+	int l, r, b;
+
+	while(1) {
+		l = 2*i + 1;
+		r = l + 1;
+		b = i;
+
+		if(l < ifc->heapsize && heap_better(l, b))
+			b = l;
+		if(r < ifc->heapsize && heap_better(r, b))
+			b = r;
+		if(b == i)
+			break;
+
+		heap_swap(i, b);
+		i = b;
+	}
+}
+
+void unrank_scan(struct scan* sc)
+{
+	int idx = sc - ifc->scans;
+	int i = ifc->heappos[idx] - 1;
+	int last;
+
+	if(i < 0)
+		return;
+
+	ifc->heappos[idx] = 0;
+
+	if(i == --ifc->heapsize)
+		return;
+
+	last = ifc->heap[ifc->heapsize];
+	ifc->heap[i] = last;
+	ifc->heappos[last] = i + 1;
+
+	sift_up(i);
+	sift_down(ifc->heappos[last] - 1);
+}
+
+static void rank_scan(struct scan* sc)
+{
+	int idx = sc - ifc->scans;
+	int i = ifc->heappos[idx] - 1;
+
+	if(!candidate(sc))
+		return unrank_scan(sc);
+
+	if(i < 0) {
+		i = ifc->heapsize++;
+		ifc->heap[i] = idx;
+		ifc->heappos[idx] = i + 1;
+	}
+
+	sift_up(i);
+	sift_down(ifc->heappos[idx] - 1);
+}
+
+static void rescore(struct scan* sc)
+{
+	sc->score = sc->tput*hist_score(sc->bssid)/100;
+}
+
+static void rebuild_ranking(void)
 {
 	struct scan* sc;
-	struct scan* best = NULL;
+	int i;
 
-	for(sc = scans; sc < scans + nscans; sc++) {
-		if(!sc->freq)
-			continue;
-		if(!connectable(sc))
+	memzero(ifc->heappos, sizeof(ifc->heappos));
+	ifc->heapsize = 0;
+	ifc->rankexpiry = 0;
+
+	for(sc = ifc->scans; sc < ifc->scans + ifc->nscans; sc++) {
+		if(!candidate(sc))
 			continue;
-		if(!match_ssid(sc))
+
+		rescore(sc);
+
+		i = ifc->heapsize++;
+		ifc->heap[i] = sc - ifc->scans;
+		ifc->heappos[ifc->heap[i]] = i + 1;
+	}
+
+	for(i = ifc->heapsize/2 - 1; i >= 0; i--)
+		sift_down(i);
+
+	ifc->rankstale = 0;
+}
+
+void rerank_bssid(byte bssid[6])
+{
+	struct scan* sc;
+
+	if(ifc->rankstale)
+		return;
+	if(!(sc = find_scan_slot(bssid)))
+		return;
+
+	rescore(sc);
+	rank_scan(sc);
+}
+
+void invalidate_ranking(void)
+{
+	ifc->rankstale = 1;
+}
+
+/* ESS records and PSKs are shared between the interfaces,
+   so a change in either may affect all of them. */
+
+void invalidate_rankings(void)
+{
+	struct iface* fi;
+
+	for(fi = ifaces; fi < ifaces + nifaces; fi++)
+		fi->rankstale = 1;
+}
+
+static struct scan* get_best_ap(void)
+{
+	if(ifc->rankexpiry && uptime() >= ifc->rankexpiry)
+		ifc->rankstale = 1;
+	if(ifc->rankstale)
+		rebuild_ranking();
+	if(!ifc->heapsize)
+		return NULL;
+
+	return ifc->scans + ifc->heap[0];
+}
+
+/* Chunked full scans check the channels of APs we could connect to first.
+   Given the kind of networks wsupp is used with, the AP we're looking
+   for is very likely to be still there. */
+
+int known_ap_freq(int freq)
+{
+	struct scan* sc;
+
+	if(ifc->ap.freq == freq)
+		return 1;
+
+	for(sc = ifc->scans; sc < ifc->scans + ifc->nscans; sc++) {
+		if(sc->freq != freq)
 			continue;
-		if(compare(sc, best) <= 0)
+		if(!(sc->flags & SF_GOOD))
 			continue;
-		best = sc;
+		if(ifc->ap.fixed ? match_ssid(sc) : got_pass(sc))
+			return 1;
 	}
 
-	return best;
+	return 0;
+}
+
+int got_good_enough_ap(void)
+{
+	struct scan* sc;
+
+	if(!(sc = get_best_ap()))
+		return 0;
+
+	return (sc->signal >= GOOD_ENOUGH_SIGNAL);
 }
 
 static void clear_ap_bssid(void)
 {
-	ap.type = 0;
-	ap.success = 0;
-	ap.rescans = 0;
+	ifc->ap.type = 0;
+	ifc->ap.success = 0;
+	ifc->ap.rescans = 0;
+
+	memzero(&ifc->ap.bssid, sizeof(ifc->ap.bssid));
+}
+
+static void set_ap_ssid(byte* ssid, int slen)
+{
+	drop_ess(ifc->ap.ess);
 
-	memzero(&ap.bssid, sizeof(ap.bssid));
+	memcpy(ifc->ap.ssid, ssid, slen);
+	ifc->ap.slen = slen;
+	ifc->ap.ess = grab_ess(ssid, slen);
 }
 
 static void clear_ap_ssid(void)
 {
-	ap.slen = 0;
-	ap.freq = 0;
-	ap.fixed = 0;
-	memzero(&ap.ssid, sizeof(ap.ssid));
-	memzero(PSK, sizeof(PSK));
-	ap.unsaved = 0;
+	drop_ess(ifc->ap.ess);
+	ifc->rankstale = 1;
+
+	ifc->ap.ess = 0;
+	ifc->ap.slen = 0;
+	ifc->ap.freq = 0;
+	ifc->ap.fixed = 0;
+	memzero(&ifc->ap.ssid, sizeof(ifc->ap.ssid));
+	wipe_psk();
+	ifc->ap.unsaved = 0;
 }
 
 void reset_station(void)
@@ -172,32 +495,32 @@ static int set_current_ap(struct scan* sc)
 	int auth = sc->type;
 
 	sc->flags |= SF_TRIED;
+	unrank_scan(sc);
 
-	ap.success = 0;
-	ap.freq = sc->freq;
-	ap.type = sc->type;
-	memcpy(ap.bssid, sc->bssid, MACLEN);
+	ifc->ap.success = 0;
+	ifc->ap.freq = sc->freq;
+	ifc->ap.type = sc->type;
+	memcpy(ifc->ap.bssid, sc->bssid, MACLEN);
 
 	if(!(auth & ST_RSN_P_CCMP))
 		return -1;
 
 	if(auth & ST_RSN_G_TKIP) {
-		ap.ies = ies_ccmp_tkip;
-		ap.iesize = sizeof(ies_ccmp_tkip);
-		ap.tkipgroup = 1;
+		ifc->ap.ies = ies_ccmp_tkip;
+		ifc->ap.iesize = sizeof(ies_ccmp_tkip);
+		ifc->ap.tkipgroup = 1;
 	} else {
-		ap.ies = ies_ccmp_ccmp;
-		ap.iesize = sizeof(ies_ccmp_ccmp);
-		ap.tkipgroup = 0;
+		ifc->ap.ies = ies_ccmp_ccmp;
+		ifc->ap.iesize = sizeof(ies_ccmp_ccmp);
+		ifc->ap.tkipgroup = 0;
 	}
 
-	if(ap.fixed)
+	if(ifc->ap.fixed)
 		return 0;
 
-	ap.slen = sc->slen;
-	memcpy(ap.ssid, sc->ssid, sc->slen);
+	set_ap_ssid(esses[sc->ess].ssid, esses[sc->ess].slen);
 
-	if(load_psk(ap.ssid, ap.slen, PSK))
+	if(load_psk(ifc->ap.ssid, ifc->ap.slen, ifc->PSK))
 		return -1;
 
 	return 0;
@@ -207,20 +530,12 @@ static struct scan* find_current_ap(void)
 {
 	struct scan* sc;
 
-	for(sc = scans; sc < scans + nscans; sc++) {
-		if(!sc->freq)
-			continue;
-		if(sc->slen != ap.slen)
-			continue;
-		if(memcmp(sc->ssid, ap.ssid, ap.slen))
-			continue;
-		if(memcmp(sc->bssid, ap.bssid, 6))
-			continue;
-
-		return sc;
-	}
+	if(!(sc = find_scan_slot(ifc->ap.bssid)))
+		return NULL;
+	if(!sc->freq || sc->ess != ifc->ap.ess)
+		return NULL;
 
-	return NULL;
+	return sc;
 }
 
 /* Fixed AP mode means fixed SSID, *not* fixed BSSID, and we should be
@@ -232,7 +547,7 @@ static void reset_scan_counters()
 {
 	struct scan* sc;
 
-	for(sc = scans; sc < scans + nscans; sc++) {
+	for(sc = ifc->scans; sc < ifc->scans + ifc->nscans; sc++) {
 		if(!sc->freq)
 			continue;
 		if(!match_ssid(sc))
@@ -240,17 +555,19 @@ static void reset_scan_counters()
 
 		sc->flags &= ~SF_TRIED;
 	}
+
+	ifc->rankstale = 1;
 }
 
 static int set_fixed(byte* ssid, int slen)
 {
-	if(slen > (int)sizeof(ap.ssid))
+	if(slen > (int)sizeof(ifc->ap.ssid))
 		return -ENAMETOOLONG;
 
-	memcpy(ap.ssid, ssid, slen);
-	ap.slen = slen;
+	set_ap_ssid(ssid, slen);
 
-	ap.fixed = 1;
+	ifc->ap.fixed = 1;
+	ifc->rankstale = 1;
 
 	clear_ap_bssid();
 	reset_scan_counters();
@@ -265,9 +582,9 @@ int set_fixed_given(byte* ssid, int slen, byte psk[32])
 	if((ret = set_fixed(ssid, slen)) < 0)
 		return ret;
 
-	memcpy(PSK, psk, 32);
+	memcpy(ifc->PSK, psk, 32);
 
-	ap.unsaved = 1;
+	ifc->ap.unsaved = 1;
 
 	return 0;
 }
@@ -276,12 +593,12 @@ int set_fixed_saved(byte* ssid, int slen)
 {
 	int ret;
 
-	if((ret = load_psk(ssid, slen, PSK)) < 0)
+	if((ret = load_psk(ssid, slen, ifc->PSK)) < 0)
 		return ret;
 	if((ret = set_fixed(ssid, slen)) < 0)
 		return ret;
 
-	ap.unsaved = 0;
+	ifc->ap.unsaved = 0;
 
 	return 0;
 }
@@ -298,6 +615,7 @@ static int connect_to_something(void)
 		else return 1;
 
 		sc->flags &= ~SF_GOOD;
+		unrank_scan(sc);
 	}
 
 	return 0;
@@ -307,45 +625,292 @@ void handle_connect(void)
 {
 	struct scan* sc;
 
-	ap.success = 1;
-	ap.fixed = 1;
+	ifc->ap.success = 1;
+	ifc->ap.fixed = 1;
+	ifc->rankstale = 1;
+	ifc->cacheonly = 0;
+	ifc->connectedat = uptime();
 
 	set_timer(TIME_TO_BG_SCAN);
 
-	if(opermode == OP_RESCAN)
-		opermode = OP_ACTIVE;
-	if(opermode == OP_ONESHOT)
-		opermode = OP_ACTIVE;
+	if(ifc->opermode == OP_RESCAN)
+		ifc->opermode = OP_ACTIVE;
+	if(ifc->opermode == OP_ONESHOT)
+		ifc->opermode = OP_ACTIVE;
 
 	if((sc = find_current_ap()))
 		sc->flags &= ~SF_TRIED;
-	if(ap.unsaved)
-		save_psk(ap.ssid, ap.slen, PSK);
-	if(ap.unsaved && sc)
-		sc->flags |= SF_PASS;
 
-	ap.unsaved = 0;
+	clear_failures(ifc->ap.bssid);
+	hist_connected(ifc->ap.bssid, sc ? sc->signal : 0);
+	if(ifc->ap.unsaved)
+		save_psk(ifc->ap.ssid, ifc->ap.slen, ifc->PSK);
+	if(ifc->ap.unsaved && ifc->ap.ess) {
+		esses[ifc->ap.ess].flags |= EF_PASS;
+		invalidate_rankings();
+	}
+
+	ifc->ap.unsaved = 0;
+
+	save_scan_state();
+
+	request_neighbors();
+
+	if(!ifc->roaming)
+		trigger_dhcp();
 
-	trigger_dhcp();
+	ifc->roaming = 0;
 
 	report_connected();
 }
 
+/* Same as handle_connect() but for a link that was established by
+   a previous instance of wsupp, see adopt_link(). No DHCP, and nothing
+   worth reporting to the clients, as the link never went down. */
+
+int adopt_current_ap(struct scan* sc)
+{
+	if(ifc->ap.fixed && sc->ess != ifc->ap.ess)
+		return -1;
+	if(set_current_ap(sc))
+		return -1;
+
+	sc->flags &= ~SF_TRIED;
+
+	ifc->ap.success = 1;
+	ifc->ap.fixed = 1;
+	ifc->rankstale = 1;
+	ifc->connectedat = uptime();
+
+	if(ifc->opermode == OP_NEUTRAL)
+		ifc->opermode = OP_ACTIVE;
+
+	clear_failures(ifc->ap.bssid);
+	hist_adopted(ifc->ap.bssid);
+
+	set_timer(TIME_TO_BG_SCAN);
+
+	return 0;
+}
+
+/* Called after each scan while connected. The current AP gets left
+   only if it is getting weak, we have been with it for a while,
+   and some other AP of the same ESS is stronger by a fair margin.
+   Without the margin and the dwell time, a client standing between
+   two APs would keep bouncing between them.
+
+   The signal of the current AP is the one from the scan, just like
+   for the candidates, so that they can be compared directly. */
+
+static struct scan* find_roam_target(int minsignal)
+{
+	struct scan* sc;
+	struct scan* best = NULL;
+
+	for(sc = ifc->scans; sc < ifc->scans + ifc->nscans; sc++) {
+		if(!sc->freq || !memcmp(sc->bssid, ifc->ap.bssid, 6))
+			continue;
+		if(sc->ess != ifc->ap.ess)
+			continue;
+		if(!(sc->flags & SF_GOOD))
+			continue;
+		if(sc->flags & SF_STALE)
+			continue;
+		if(backoff_until(sc->bssid))
+			continue;
+		if(sc->signal < minsignal)
+			continue;
+		if(best && sc->signal <= best->signal)
+			continue;
+
+		best = sc;
+	}
+
+	return best;
+}
+
+/* set_current_ap() marks the target tried and takes it out of the heap.
+   If the roam does not even start, the target remains just as good
+   a candidate for the next attempt as it was. */
+
+static int roam_to(struct scan* sc)
+{
+	struct ap saved = ifc->ap;
+	int flags = sc->flags;
+
+	if(set_current_ap(sc) || start_roaming(saved.bssid)) {
+		ifc->ap = saved;
+		sc->flags = flags;
+		rank_scan(sc);
+		return -1;
+	}
+
+	ifc->roaming = 1;
+	set_timer(ROAM_TIMEOUT);
+
+	return 0;
+}
+
+/* Netlink code needs this for PREV_BSSID and to tell the old link
+   going down from the new one failing, see start_roaming(). */
+
+int is_roaming(void)
+{
+	return ifc->roaming;
+}
+
+void consider_roaming(void)
+{
+	struct scan *cur, *sc;
+
+	if(ifc->authstate != AS_CONNECTED || ifc->roaming)
+		return;
+	if(ifc->steered) {
+		ifc->steered = 0;
+		if((sc = find_transition_target()))
+			return start_transition(sc);
+	}
+	if(uptime() - ifc->connectedat < roamdwell)
+		return;
+	if(!(cur = find_current_ap()))
+		return;
+	if(cur->signal >= ROAM_THRESHOLD)
+		return;
+	if(!(sc = find_roam_target(cur->signal + roamhyst)))
+		return;
+
+	roam_to(sc);
+}
+
+/* BTM requests, see wsupp_neigh.c. The AP knows better which of its
+   neighbors we should go to, so the candidates it lists are ranked by
+   its preference first, and the dwell time and hysteresis do not apply. */
+
+struct scan* find_transition_target(void)
+{
+	struct scan* sc;
+	struct scan* best = NULL;
+	int pref, bestpref = 0;
+
+	if(ifc->authstate != AS_CONNECTED || ifc->roaming)
+		return NULL;
+
+	for(sc = ifc->scans; sc < ifc->scans + ifc->nscans; sc++) {
+		if(!sc->freq || sc->ess != ifc->ap.ess)
+			continue;
+		if(!memcmp(sc->bssid, ifc->ap.bssid, 6))
+			continue;
+		if((sc->flags & (SF_GOOD | SF_STALE)) != SF_GOOD)
+			continue;
+		if(backoff_until(sc->bssid))
+			continue;
+		if((pref = neighbor_pref(sc->bssid)) <= 0)
+			continue;
+		if(pref < bestpref)
+			continue;
+		if(pref == bestpref && sc->signal <= best->signal)
+			continue;
+
+		best = sc;
+		bestpref = pref;
+	}
+
+	return best;
+}
+
+void start_transition(struct scan* sc)
+{
+	roam_to(sc);
+}
+
+void start_transition_scan(void)
+{
+	if(ifc->authstate != AS_CONNECTED || ifc->roaming)
+		return;
+	if(start_roam_scan() < 0)
+		return;
+
+	ifc->steered = 1;
+}
+
+/* CQM events, see wsupp_netlink.c. A weak link prompts a scan of
+   the channels the ESS is known to use, and consider_roaming() gets
+   called once it is done. Packet loss may get reported over and over
+   again on a bad link, hence the rate limit. */
+
+void handle_weak_signal(void)
+{
+	int now = uptime();
+
+	if(ifc->authstate != AS_CONNECTED || ifc->roaming)
+		return;
+	if(ifc->roamscan && now - ifc->roamscan < ROAM_SCAN_INTERVAL)
+		return;
+
+	ifc->roamscan = now;
+
+	start_roam_scan();
+}
+
+/* With the beacons gone, the current AP is no longer worth comparing
+   against. Any usable AP of the same ESS will do, and if there are
+   none, dropping the link now gets rescan_current_ap() going without
+   waiting for the kernel to give up on the AP. */
+
+void handle_beacon_loss(void)
+{
+	struct scan* sc;
+
+	if(ifc->authstate != AS_CONNECTED || ifc->roaming)
+		return;
+
+	if((sc = find_roam_target(NOISE_FLOOR*100)) && !roam_to(sc))
+		return;
+
+	start_disconnect();
+}
+
+/* Scanless reconnect. The kernel keeps the BSS entries it has seen
+   for a while, and AUTHENTICATE only needs the entry to be there,
+   so the last AP may be tried directly without scanning for it first.
+   If the entry is gone, AUTHENTICATE fails with ENOENT, and if the AP
+   is gone, it times out; either way, netlink code falls back to
+   scanning the AP's frequency, see handle_auth_error(). */
+
+static int try_last_ap(void)
+{
+	struct scan* sc;
+
+	if(ifc->opermode == OP_NEUTRAL)
+		return -1;
+	if(!(sc = find_current_ap()))
+		return -1;
+	if(backoff_until(sc->bssid))
+		return -1;
+	if(set_current_ap(sc))
+		return -1;
+
+	return start_connection();
+}
+
 static void rescan_current_ap(void)
 {
-	ap.success = 0;
+	ifc->ap.success = 0;
 	/* keep the rest of ap in place */
-	opermode = OP_RESCAN;
+	ifc->opermode = OP_RESCAN;
 
-	start_scan(ap.freq);
+	if(!backoff_until(ifc->ap.bssid) && !start_connection())
+		return;
+
+	start_scan(ifc->ap.freq);
 }
 
 void reconnect_to_current_ap(void)
 {
-	if(opermode == OP_RESCAN)
-		opermode = OP_ACTIVE;
+	if(ifc->opermode == OP_RESCAN)
+		ifc->opermode = OP_ACTIVE;
 
-	if(find_current_ap())
+	if(find_current_ap() && !backoff_until(ifc->ap.bssid))
 		start_connection();
 	else
 		reassess_wifi_situation();
@@ -355,32 +920,90 @@ static void try_some_other_ap(void)
 {
 	clear_ap_bssid();
 
-	if(!ap.fixed)
+	if(!ifc->ap.fixed)
 		clear_ap_ssid();
 
 	reassess_wifi_situation();
 }
 
-/* Netlink has completed a scan dump and wants us to evaluate the results. */
+/* Config lookups are done once per ESS per dump, however many APs
+   the network has. The config may have changed since the last dump,
+   so the PSK gets looked up again whenever new APs show up. */
+
+static void check_ess_psk(struct ess* es)
+{
+	int flags = es->flags;
+
+	if(flags & EF_CHECKED)
+		return;
+
+	es->flags |= EF_CHECKED;
+
+	if(got_psk_for(es->ssid, es->slen))
+		es->flags |= EF_PASS;
+	else
+		es->flags &= ~EF_PASS;
+
+	if((flags ^ es->flags) & EF_PASS)
+		invalidate_rankings();
+}
+
+static void check_new_scan(struct scan* sc)
+{
+	sc->flags |= SF_SEEN | SF_DIRTY;
+
+	if(!check_wpa(sc))
+		return;
+
+	sc->flags |= SF_GOOD;
+
+	if(sc->ess)
+		check_ess_psk(&esses[sc->ess]);
+}
+
+static void check_staleness(struct scan* sc)
+{
+	int stale = scan_is_stale(sc) ? SF_STALE : 0;
+
+	if((sc->flags & SF_STALE) == stale)
+		return;
+
+	sc->flags ^= SF_STALE;
+	sc->flags |= SF_DIRTY;
+}
+
+/* Netlink has completed a scan dump and wants us to evaluate the results.
+   Only the entries that have been updated by the dump, or went stale
+   since the last one, get re-ranked. */
 
 void check_new_scan_results(void)
 {
 	struct scan* sc;
+	struct ess* es;
+
+	for(es = esses; es < esses + nesses; es++)
+		es->flags &= ~EF_CHECKED;
 
-	for(sc = scans; sc < scans + nscans; sc++) {
+	for(sc = ifc->scans; sc < ifc->scans + ifc->nscans; sc++) {
 		if(!sc->freq)
 			continue;
-		if(sc->flags & SF_SEEN)
+		if(!(sc->flags & SF_SEEN))
+			check_new_scan(sc);
+
+		check_staleness(sc);
+
+		if(!(sc->flags & SF_DIRTY))
 			continue;
 
-		sc->flags |= SF_SEEN;
+		sc->flags &= ~SF_DIRTY;
+		sc->tput = estimate_throughput(sc);
+		rescore(sc);
+		rank_scan(sc);
 
-		if(check_wpa(sc))
-			sc->flags |= SF_GOOD;
-		else
+		if(ifc->authstate != AS_CONNECTED)
 			continue;
-		if(got_psk_for(sc->ssid, sc->slen))
-			sc->flags |= SF_PASS;
+		if(!memcmp(sc->bssid, ifc->ap.bssid, 6))
+			hist_signal(sc->bssid, sc->signal);
 	}
 }
 
@@ -389,20 +1012,25 @@ void check_new_scan_results(void)
 void handle_disconnect(void)
 {
 	clr_timer();
+	clr_deadline();
 	kill_dhcp();
+	clear_neighbors();
 
-	if(opermode == OP_EXITREQ)
-		opermode = OP_EXIT;
-	if(opermode == OP_EXIT)
+	ifc->roaming = 0;
+	ifc->steered = 0;
+
+	if(ifc->opermode == OP_EXITREQ)
+		ifc->opermode = OP_EXIT;
+	if(ifc->opermode == OP_EXIT)
 		return;
 
 	report_disconnect();
 
-	if(opermode == OP_RESCAN)
-		opermode = OP_ACTIVE;
+	if(ifc->opermode == OP_RESCAN)
+		ifc->opermode = OP_ACTIVE;
 
-	if(opermode == OP_ACTIVE) {
-		if(ap.success)
+	if(ifc->opermode == OP_ACTIVE) {
+		if(ifc->ap.success)
 			rescan_current_ap();
 		else
 			try_some_other_ap();
@@ -413,6 +1041,29 @@ void handle_disconnect(void)
 	}
 }
 
+/* The AP moving to another channel, usually because of radar on a DFS
+   channel. The link survives that, but any reconnect or rescan would
+   go for the old channel unless ap.freq and the scan entry get updated.
+   The switch gets reported both when announced and when done; the AP
+   may go unheard in between, so the new channel is taken right away. */
+
+void handle_channel_switch(int freq)
+{
+	struct scan* sc;
+
+	if(ifc->ap.freq == freq)
+		return;
+
+	if((sc = find_current_ap()))
+		sc->freq = freq;
+
+	ifc->ap.freq = freq;
+	ifc->ap.rescans = 0;
+
+	invalidate_ranking();
+	save_scan_state();
+}
+
 /* RFkill code reports the interface to be back online.
 
    Note that if rfkill happened on a live connection, disconnect will
@@ -421,42 +1072,101 @@ void handle_disconnect(void)
 
 void handle_rfrestored(void)
 {
-	if(authstate != AS_NETDOWN)
+	if(ifc->authstate != AS_NETDOWN)
 		return; /* weren't connected before rfkill */
 
-	authstate = AS_IDLE;
+	ifc->authstate = AS_IDLE;
 
-	if(opermode == OP_RESCAN)
+	if(ifc->opermode == OP_RESCAN)
 		rescan_current_ap();
 	else
 		reassess_wifi_situation();
 }
 
+/* Results of a scan we did not request, see harvest_scan_results().
+   If we are idle, try to connect right away. Otherwise there's nothing
+   to do here, fresh scan data only means the next routine scan may be
+   skipped. reassess_wifi_situation() may have been skipped while
+   the dump was running, so this also serves to get it going again. */
+
+void handle_harvested_scan(void)
+{
+	if(ifc->authstate != AS_IDLE)
+		return;
+	if(ifc->opermode == OP_NEUTRAL)
+		return;
+
+	reassess_wifi_situation();
+}
+
+/* Results of a scan made on some other interface we manage. The data
+   radio may then find a roam target without going off-channel itself.
+   Idle interfaces only get going if there is something to try; if not,
+   their own routine scans go on as scheduled. */
+
+void handle_shared_scan(void)
+{
+	if(ifc->authstate == AS_CONNECTED)
+		return consider_roaming();
+	if(ifc->authstate != AS_IDLE || ifc->opermode == OP_NEUTRAL)
+		return;
+	if(get_best_ap())
+		reassess_wifi_situation();
+}
+
 /* Foreground scan means scanning while not connected,
-   background respectively means there's an active connection. */
+   background respectively means there's an active connection.
+
+   If somebody else has scanned recently enough, there's no point
+   in running another scan right now. */
+
+static int fresh_scan_data(int period)
+{
+	if(!ifc->lastscan)
+		return 0;
+
+	return (uptime() - ifc->lastscan < period/2);
+}
+
+static int fg_scan_period(void)
+{
+	if(ifc->ap.fixed && ifc->ap.freq)
+		return TIME_TO_RESCAN;
+	else
+		return TIME_TO_FG_SCAN;
+}
 
 void routine_bg_scan(void)
 {
-	start_void_scan();
 	set_timer(TIME_TO_BG_SCAN);
+
+	if(fresh_scan_data(TIME_TO_BG_SCAN))
+		return;
+
+	start_void_scan();
 }
 
 void routine_fg_scan(void)
 {
-	if(!ap.fixed) {
+	int period = fg_scan_period();
+
+	if(fresh_scan_data(period))
+		return set_timer(period);
+
+	if(!ifc->ap.fixed) {
 		set_timer(TIME_TO_FG_SCAN);
 		start_void_scan();
-	} else if(ap.freq) {
-		set_timer(10);
+	} else if(ifc->ap.freq) {
+		set_timer(TIME_TO_RESCAN);
 
-		if(++ap.rescans % 6)
-			start_scan(ap.freq);
+		if(++ifc->ap.rescans % 6)
+			start_scan(ifc->ap.freq);
 		else
 			start_full_scan();
 
-		if(ap.rescans >= 6*5) { /* 5 minutes */
-			ap.freq = 0;
-			ap.rescans = 0;
+		if(ifc->ap.rescans >= 6*5) { /* 5 minutes */
+			ifc->ap.freq = 0;
+			ifc->ap.rescans = 0;
 		}
 	} else {
 		set_timer(TIME_TO_FG_SCAN);
@@ -468,7 +1178,7 @@ static void snap_to_neutral(void)
 {
 	clear_ap_bssid();
 	clear_ap_ssid();
-	opermode = OP_NEUTRAL;
+	ifc->opermode = OP_NEUTRAL;
 }
 
 static void idle_then_rescan(void)
@@ -476,21 +1186,75 @@ static void idle_then_rescan(void)
 	set_timer(TIME_TO_FG_SCAN);
 }
 
+/* Connection attempts made off the kernel scan cache on startup
+   skip the initial scan. If none of them work out, the scan must
+   be done right away instead of idling until the next routine one. */
+
+void startup_scan(void)
+{
+	if(!try_last_ap()) {
+		ifc->cacheonly = 1;
+		set_timer(TIME_TO_FG_SCAN);
+	} else if(dump_cached_scan() < 0) {
+		routine_fg_scan();
+	}
+}
+
+/* Timers do not run while the host is suspended, see check_resume().
+   Most drivers drop the link on suspend, and the disconnect gets
+   reported on resume, taking the fast path in rescan_current_ap().
+   If we were idle, the last AP gets tried directly, and whatever
+   routine scan the timer was set for is overdue anyway. */
+
+void handle_resume(void)
+{
+	if(ifc->authstate != AS_IDLE || ifc->scanstate != SS_IDLE)
+		return;
+	if(ifc->opermode == OP_NEUTRAL)
+		return;
+
+	if(!try_last_ap()) {
+		ifc->cacheonly = 1;
+		set_timer(TIME_TO_FG_SCAN);
+	} else {
+		routine_fg_scan();
+	}
+}
+
+void handle_cached_scan(void)
+{
+	if(ifc->opermode == OP_NEUTRAL || !get_best_ap())
+		return routine_fg_scan();
+
+	ifc->cacheonly = 1;
+	set_timer(TIME_TO_FG_SCAN);
+
+	reassess_wifi_situation();
+}
+
+static void scan_past_cache(void)
+{
+	ifc->cacheonly = 0;
+	routine_fg_scan();
+}
+
 void reassess_wifi_situation(void)
 {
-	if(opermode == OP_NEUTRAL)
+	if(ifc->opermode == OP_NEUTRAL)
 		return;
-	if(authstate != AS_IDLE)
+	if(ifc->authstate != AS_IDLE)
 		return;
-	if(scanstate != SS_IDLE)
+	if(ifc->scanstate != SS_IDLE)
 		return;
 
 	if(connect_to_something())
 		return;
+	if(ifc->cacheonly)
+		return scan_past_cache();
 
 	report_no_connect();
 
-	if(opermode == OP_ONESHOT)
+	if(ifc->opermode == OP_ONESHOT)
 		snap_to_neutral();
 	else
 		idle_then_rescan();
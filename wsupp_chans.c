@@ -0,0 +1,345 @@
+#include <string.h>
+#include <errno.h>
+
+#include "common.h"
+
+#include "netlink.h"
+#include "netlink/genl.h"
+#include "netlink/genl/nl80211.h"
+
+#include "wsupp.h"
+
+/* Channels the card can tune to, along with the order in which
+   full-range scans cover them.
+
+   A regular TRIGGER_SCAN with no frequencies listed makes the card
+   go through every channel it supports, which may take several seconds,
+   and none of the results get evaluated until the very end. Full scans
+   issued to find something to connect to are instead split into chunks
+   which get scanned one by one:
+
+       0. channels where usable APs have been seen before
+       1. 5GHz channels that do not require radar detection
+       2. 2.4GHz channels
+       3. 5GHz DFS channels (passive scan only, slow)
+       4. 6GHz PSC channels, and those advertised by 2.4/5GHz APs
+
+   and the netlink code stops going through them once a good enough AP
+   turns up. DFS channels come late since passive scanning takes much
+   more time per channel, and APs on them tend to be few. Still, 6GHz
+   APs require SAE which we do not support, so a 6GHz scan cannot turn
+   up anything to connect to, and goes last. It's only done to keep
+   the scan list complete.
+
+   The 6GHz band has way too many channels to scan blindly. APs there are
+   expected to either sit on one of the preferred scanning channels (PSC),
+   or to be advertised in Reduced Neighbor Reports by colocated 2.4/5GHz
+   APs. The channels from RNRs get marked as the IEs are parsed, and the
+   card gets told to do the same with NL80211_SCAN_FLAG_COLOCATED_6GHZ.
+   Being last also means the RNRs are known by the time it runs.
+
+   With several interfaces looking for APs at the same time, each channel
+   only needs to be scanned by one of them, as the results get shared,
+   see share_scan(). Channels taken by an interface are taken for those
+   in the middle of their own cycles as well, and an interface starting
+   a cycle skips whatever the others have already taken. Chunks go by
+   band, so the radios end up scanning different bands in parallel.
+
+   The list of channels is queried once on startup. If that fails,
+   full scans are not chunked. */
+
+#define NCHUNKS 5
+
+/* Scan entries are never dropped just because a single scan missed
+   them, probe responses do get lost. Instead, each channel remembers
+   when it was last scanned, and an AP that has not been seen in scans
+   of its channel for this long is considered stale. Stale entries are
+   still usable, they just get tried after the fresh ones.
+
+   Passive scans on DFS channels only catch beacons, and miss APs more
+   often than active ones. If the channel list is not known, the age
+   of the entry is all there is to go on. */
+
+#define TTL_ACTIVE   20
+#define TTL_PASSIVE  60
+#define TTL_NOCHAN   2*60
+
+extern struct netlink nl;
+extern int nl80211;
+
+
+static int is_2ghz(int freq)
+{
+	return (freq >= 2400 && freq < 2500);
+}
+
+static int is_5ghz(int freq)
+{
+	return (freq >= 4900 && freq < 5925);
+}
+
+static int is_6ghz(int freq)
+{
+	return (freq > 5925 && freq <= 7125);
+}
+
+/* PSC are 6GHz channels 5, 21, 37, ... 229.
+   Ref. IEEE 802.11ax-2021 26.17.2.3.3 */
+
+static int is_psc(int freq)
+{
+	if(!is_6ghz(freq) || freq < 5950)
+		return 0;
+
+	return ((freq - 5950)/5 % 16 == 5);
+}
+
+static int query_wiphy_index(void)
+{
+	struct nlgen* msg;
+	uint32_t* idx;
+
+	nl_new_cmd(&nl, nl80211, NL80211_CMD_GET_INTERFACE, 0);
+	nl_put_u32(&nl, NL80211_ATTR_IFINDEX, ifc->ifindex);
+
+	if(!(msg = nl_send_recv_genl(&nl)))
+		return nl.err ? nl.err : -EBADMSG;
+	if(!(idx = nl_get_u32(msg, NL80211_ATTR_WIPHY)))
+		return -EBADMSG;
+
+	return *idx;
+}
+
+static void add_channel(struct nlattr* at)
+{
+	struct chan* ch;
+	uint32_t* freq;
+
+	if(!(freq = nl_sub_u32(at, NL80211_FREQUENCY_ATTR_FREQ)))
+		return;
+	if(nl_sub(at, NL80211_FREQUENCY_ATTR_DISABLED))
+		return;
+
+	for(ch = ifc->chans; ch < ifc->chans + ifc->nchans; ch++)
+		if(ch->freq == (int)*freq)
+			return;
+	if(ifc->nchans >= NCHANS)
+		return;
+
+	ch->freq = *freq;
+	ch->flags = 0;
+
+	if(nl_sub(at, NL80211_FREQUENCY_ATTR_RADAR))
+		ch->flags |= CF_RADAR;
+
+	ifc->nchans++;
+}
+
+static void parse_wiphy_bands(struct nlgen* msg)
+{
+	struct nlattr *bands, *band, *freqs, *at;
+
+	if(!(bands = nl_get_nest(msg, NL80211_ATTR_WIPHY_BANDS)))
+		return;
+
+	for(band = nl_sub_0(bands); band; band = nl_sub_n(bands, band)) {
+		if(!(freqs = nl_nest(nl_sub(band, NL80211_BAND_ATTR_FREQS))))
+			continue;
+		for(at = nl_sub_0(freqs); at; at = nl_sub_n(freqs, at))
+			if(nl_attr_is_nest(at))
+				add_channel(at);
+	}
+}
+
+/* Band info only comes complete in split dumps, and only if asked for
+   explicitly. Non-split GET_WIPHY replies may get truncated. */
+
+void setup_chans(void)
+{
+	struct nlgen* msg;
+	struct chan* ch;
+	int wiphy;
+
+	if((wiphy = query_wiphy_index()) < 0)
+		return warn("cannot query wiphy for %s\n", ifc->ifname);
+
+	nl_new_cmd(&nl, nl80211, NL80211_CMD_GET_WIPHY, 0);
+	nl_put_u32(&nl, NL80211_ATTR_WIPHY, wiphy);
+	nl_put_empty(&nl, NL80211_ATTR_SPLIT_WIPHY_DUMP);
+
+	if(nl_send_dump(&nl))
+		return warn("cannot query channels for %s\n", ifc->ifname);
+
+	while((msg = nl_recv_genl_multi(&nl)))
+		parse_wiphy_bands(msg);
+
+	if(nl.err)
+		ifc->nchans = 0;
+
+	for(ch = ifc->chans; ch < ifc->chans + ifc->nchans; ch++)
+		if(is_6ghz(ch->freq))
+			ifc->got6ghz = 1;
+}
+
+/* Cards that know nothing about 6GHz likely run on kernels that
+   know nothing about the colocated scan flag either. */
+
+int scan_colocated_6ghz(void)
+{
+	return ifc->got6ghz;
+}
+
+static struct chan* iface_chan(struct iface* fi, int freq)
+{
+	struct chan* ch;
+
+	for(ch = fi->chans; ch < fi->chans + fi->nchans; ch++)
+		if(ch->freq == freq)
+			return ch;
+
+	return NULL;
+}
+
+static struct chan* find_chan(int freq)
+{
+	return iface_chan(ifc, freq);
+}
+
+/* Scan results are shared, so a channel scanned by any interface
+   counts as scanned for all of them. */
+
+void mark_scanned_freq(int freq, int when)
+{
+	struct iface* fi;
+	struct chan* ch;
+
+	for(fi = ifaces; fi < ifaces + nifaces; fi++)
+		if((ch = iface_chan(fi, freq)))
+			ch->scanned = when;
+}
+
+int scan_is_stale(struct scan* sc)
+{
+	struct chan* ch;
+	int ttl;
+
+	if(!(ch = find_chan(sc->freq)))
+		return (uptime() - sc->seen > TTL_NOCHAN);
+
+	ttl = (ch->flags & CF_RADAR) ? TTL_PASSIVE : TTL_ACTIVE;
+
+	return (ch->scanned - sc->seen > ttl);
+}
+
+/* Survey data gets dumped along with the results of our own scans,
+   see wsupp_netlink.c. Busy time is scaled to 0..255 to match BSS Load
+   channel utilization. */
+
+void set_channel_busy(int freq, int busy)
+{
+	struct chan* ch;
+
+	if((ch = find_chan(freq)))
+		ch->busy = busy;
+}
+
+int channel_busy(int freq)
+{
+	struct chan* ch;
+
+	if((ch = find_chan(freq)))
+		return ch->busy;
+
+	return 0;
+}
+
+/* Without the channel list, any frequency may be tried. */
+
+int chan_usable(int freq)
+{
+	return !ifc->nchans || find_chan(freq);
+}
+
+void mark_rnr_channel(int freq)
+{
+	struct chan* ch;
+
+	if((ch = find_chan(freq)))
+		ch->flags |= CF_RNR;
+}
+
+static int in_chunk(struct chan* ch, int stage)
+{
+	int freq = ch->freq;
+
+	switch(stage) {
+		case 0: return known_ap_freq(freq);
+		case 1: return is_5ghz(freq) && !(ch->flags & CF_RADAR);
+		case 2: return is_2ghz(freq);
+		case 3: return is_5ghz(freq) && (ch->flags & CF_RADAR);
+		case 4: return is_psc(freq) || (ch->flags & CF_RNR);
+		default: return 0;
+	}
+}
+
+static int mid_cycle(struct iface* fi)
+{
+	return (fi != ifc && fi->scanchunk > 0);
+}
+
+static void take_chan(struct iface* fi, int freq)
+{
+	struct chan* ch;
+
+	if((ch = iface_chan(fi, freq)))
+		ch->flags |= CF_SCANNED;
+}
+
+void reset_scan_chunks(void)
+{
+	struct iface* fi;
+	struct chan* ch;
+
+	for(ch = ifc->chans; ch < ifc->chans + ifc->nchans; ch++)
+		ch->flags &= ~CF_SCANNED;
+
+	for(fi = ifaces; fi < ifaces + nifaces; fi++) {
+		if(!mid_cycle(fi))
+			continue;
+		for(ch = fi->chans; ch < fi->chans + fi->nchans; ch++)
+			if(ch->flags & CF_SCANNED)
+				take_chan(ifc, ch->freq);
+	}
+}
+
+/* Returns the number of frequencies placed into freqs[], which may be 0
+   for empty chunks, or -ENOENT past the last chunk. Each channel gets
+   scanned once per cycle, whichever chunk picks it first. */
+
+int fill_scan_chunk(int stage, int* freqs, int max)
+{
+	struct iface* fi;
+	struct chan* ch;
+	int n = 0;
+
+	if(stage >= NCHUNKS)
+		return -ENOENT;
+
+	for(ch = ifc->chans; ch < ifc->chans + ifc->nchans; ch++) {
+		if(n >= max)
+			break;
+		if(ch->flags & CF_SCANNED)
+			continue;
+		if(!in_chunk(ch, stage))
+			continue;
+
+		ch->flags |= CF_SCANNED;
+		freqs[n++] = ch->freq;
+
+		for(fi = ifaces; fi < ifaces + nifaces; fi++)
+			if(mid_cycle(fi))
+				take_chan(fi, ch->freq);
+	}
+
+	return n;
+}
@@ -45,6 +45,8 @@ static void send_report(char* buf, int len)
 	for(cn = conns; cn < conns + nconns; cn++) {
 		if(!cn->rep || (fd = cn->fd) <= 0)
 			continue;
+		if(cn->ifi != ifc->ifindex)
+			continue;
 
 		struct itimerval old, itv = {
 			.it_interval = { 0, 0 },
@@ -110,9 +112,9 @@ static void report_station(int cmd)
 	};
 
 	uc_put_hdr(&uc, cmd);
-	uc_put_bin(&uc, ATTR_BSSID, ap.bssid, sizeof(ap.bssid));
-	uc_put_bin(&uc, ATTR_SSID, ap.ssid, ap.slen);
-	uc_put_int(&uc, ATTR_FREQ, ap.freq);
+	uc_put_bin(&uc, ATTR_BSSID, ifc->ap.bssid, sizeof(ifc->ap.bssid));
+	uc_put_bin(&uc, ATTR_SSID, ifc->ap.ssid, ifc->ap.slen);
+	uc_put_int(&uc, ATTR_FREQ, ifc->ap.freq);
 	uc_put_end(&uc);
 
 	send_report(uc.brk, uc.ptr - uc.brk);
@@ -161,7 +163,8 @@ static int reply(CN, int err)
 
 static int estimate_status(void)
 {
-	int scansp = nscans*(sizeof(struct scan) + 10*sizeof(struct ucattr));
+	int scansz = sizeof(struct scan) + 10*sizeof(struct ucattr);
+	int scansp = ifc->nscans*scansz;
 
 	return scansp + 128;
 }
@@ -187,15 +190,15 @@ static void free_heap(struct heap* hp)
 
 static int common_wifi_state(void)
 {
-	if(authstate == AS_CONNECTED)
+	if(ifc->authstate == AS_CONNECTED)
 		return WS_CONNECTED;
-	if(authstate == AS_NETDOWN)
-		return rfkilled ? WS_RFKILLED : WS_NETDOWN;
-	if(authstate == AS_EXTERNAL)
+	if(ifc->authstate == AS_NETDOWN)
+		return ifc->rfkilled ? WS_RFKILLED : WS_NETDOWN;
+	if(ifc->authstate == AS_EXTERNAL)
 		return WS_EXTERNAL;
-	if(authstate != AS_IDLE)
+	if(ifc->authstate != AS_IDLE)
 		return WS_CONNECTING;
-	if(scanstate != SS_IDLE)
+	if(ifc->scanstate != SS_IDLE)
 		return WS_SCANNING;
 
 	return WS_IDLE;
@@ -203,33 +206,35 @@ static int common_wifi_state(void)
 
 static void put_status_wifi(struct ucbuf* uc)
 {
-	uc_put_int(uc, ATTR_IFI, ifindex);
-	uc_put_str(uc, ATTR_NAME, ifname);
+	uc_put_int(uc, ATTR_IFI, ifc->ifindex);
+	uc_put_str(uc, ATTR_NAME, ifc->ifname);
 	uc_put_int(uc, ATTR_STATE, common_wifi_state());
 
-	if(authstate != AS_IDLE || ap.fixed)
-		uc_put_bin(uc, ATTR_SSID, ap.ssid, ap.slen);
-	if(authstate != AS_IDLE) {
-		uc_put_bin(uc, ATTR_BSSID, ap.bssid, sizeof(ap.bssid));
-		uc_put_int(uc, ATTR_FREQ, ap.freq);
+	if(ifc->authstate != AS_IDLE || ifc->ap.fixed)
+		uc_put_bin(uc, ATTR_SSID, ifc->ap.ssid, ifc->ap.slen);
+	if(ifc->authstate != AS_IDLE) {
+		uc_put_bin(uc, ATTR_BSSID, ifc->ap.bssid, 6);
+		uc_put_int(uc, ATTR_FREQ, ifc->ap.freq);
 	}
 }
 
 static void put_status_scans(struct ucbuf* uc)
 {
 	struct scan* sc;
+	struct ess* es;
 	struct ucattr* nn;
 
-	for(sc = scans; sc < scans + nscans; sc++) {
+	for(sc = ifc->scans; sc < ifc->scans + ifc->nscans; sc++) {
 		if(!sc->freq) continue;
+		es = &esses[sc->ess];
 		nn = uc_put_nest(uc, ATTR_SCAN);
 		uc_put_int(uc, ATTR_FREQ,   sc->freq);
 		uc_put_int(uc, ATTR_TYPE,   sc->type);
 		uc_put_int(uc, ATTR_SIGNAL, sc->signal);
 		uc_put_bin(uc, ATTR_BSSID,  sc->bssid, sizeof(sc->bssid));
-		uc_put_bin(uc, ATTR_SSID,   sc->ssid, sc->slen);
+		uc_put_bin(uc, ATTR_SSID,   es->ssid, es->slen);
 
-		if(!(sc->flags & SF_PASS))
+		if(!(es->flags & EF_PASS))
 			;
 		else if(!(sc->flags & SF_GOOD))
 			;
@@ -266,8 +271,8 @@ static int cmd_device(CN, MSG)
 
 	uc_buf_set(&uc, buf, sizeof(buf));
 	uc_put_hdr(&uc, 0);
-	uc_put_int(&uc, ATTR_IFI, ifindex);
-	uc_put_str(&uc, ATTR_NAME, ifname);
+	uc_put_int(&uc, ATTR_IFI, ifc->ifindex);
+	uc_put_str(&uc, ATTR_NAME, ifc->ifname);
 	uc_put_end(&uc);
 
 	return send_reply(cn);
@@ -289,7 +294,7 @@ static int cmd_neutral(CN, MSG)
 {
 	int ret;
 
-	opermode = OP_NEUTRAL;
+	ifc->opermode = OP_NEUTRAL;
 
 	if((ret = start_disconnect()) < 0)
 		return ret;
@@ -337,15 +342,15 @@ static int cmd_connect(CN, MSG)
 {
 	int ret;
 
-	if(authstate != AS_IDLE)
+	if(ifc->authstate != AS_IDLE)
 		return -EBUSY;
-	if(scanstate != SS_IDLE)
+	if(ifc->scanstate != SS_IDLE)
 		return -EBUSY;
 
 	if((ret = configure_station(msg)) < 0)
 		return ret;
 
-	opermode = OP_ONESHOT;
+	ifc->opermode = OP_ONESHOT;
 
 	cn->rep = 1;
 
@@ -362,7 +367,7 @@ static int cmd_forget(CN, MSG)
 {
 	int ret;
 	struct ucattr* at;
-	struct scan* sc;
+	int id;
 
 	if(!(at = uc_get(msg, ATTR_SSID)))
 		return -EINVAL;
@@ -373,12 +378,10 @@ static int cmd_forget(CN, MSG)
 	if((ret = drop_psk(ssid, slen)) < 0)
 		return ret;
 
-	for(sc = scans; sc < scans + nscans; sc++)
-		if(sc->slen != slen)
-			;
-		else if(memcmp(sc->ssid, ssid, slen))
-			;
-		else sc->flags &= ~SF_PASS;
+	if((id = find_ess(ssid, slen)))
+		esses[id].flags &= ~EF_PASS;
+
+	invalidate_rankings();
 
 	return 0;
 }
@@ -395,12 +398,41 @@ static const struct cmd {
 	{ CMD_WI_FORGET,  cmd_forget  }
 };
 
+/* Commands apply to the interface given by ATTR_IFI or ATTR_NAME,
+   or to the first one if there's neither. The client then gets
+   the reports for that interface only. */
+
+static struct iface* find_iface(MSG)
+{
+	int* ifi = uc_get_int(msg, ATTR_IFI);
+	char* name = uc_get_str(msg, ATTR_NAME);
+	struct iface* fi;
+
+	if(!ifi && !name)
+		return ifaces;
+
+	for(fi = ifaces; fi < ifaces + nifaces; fi++)
+		if(ifi && *ifi == fi->ifindex)
+			return fi;
+		else if(name && !strcmp(name, fi->ifname))
+			return fi;
+
+	return NULL;
+}
+
 static int dispatch_cmd(CN, MSG)
 {
 	const struct cmd* cd;
 	int cmd = msg->cmd;
 	int ret;
 
+	if(!(ifc = find_iface(msg)))
+		return reply(cn, -ENODEV);
+	if(ifc->opermode == OP_EXIT)
+		return reply(cn, -ENETDOWN);
+
+	cn->ifi = ifc->ifindex;
+
 	for(cd = commands; cd < commands + ARRAY_SIZE(commands); cd++)
 		if(cd->cmd != cmd)
 			continue;
@@ -493,9 +493,11 @@ int drop_psk(byte* ssid, int slen)
 void load_state(void)
 {
 	int fd, rd, ret;
-	char* name = WICAP;
+	char name[PATHLEN];
 	char buf[64];
 
+	iface_path(name, sizeof(name), WICAP, "");
+
 	if((fd = open(name, O_RDONLY)) < 0)
 		return;
 	if((rd = read(fd, buf, sizeof(buf))) < 0)
@@ -507,8 +509,8 @@ void load_state(void)
 	if((ret = set_fixed_saved(ssid, slen)) < 0)
 		goto out;
 
-	opermode = OP_ACTIVE;
-	ap.fixed = 1;
+	ifc->opermode = OP_ACTIVE;
+	ifc->ap.fixed = 1;
 out:
 	close(fd);
 	unlink(name);
@@ -517,12 +519,15 @@ out:
 void save_state(void)
 {
 	int fd;
-	char* name = WICAP;
-	char* buf = (char*)ap.ssid;
-	int len = ap.slen;
+	char name[PATHLEN];
+	char* buf = (char*)ifc->ap.ssid;
+	int len = ifc->ap.slen;
 
-	if(!ap.fixed)
+	if(!ifc->ap.fixed)
 		return;
+
+	iface_path(name, sizeof(name), WICAP, "");
+
 	if((fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0)
 		return;
 
@@ -2,7 +2,6 @@
 #include <errno.h>
 
 #include "common.h"
-#include "crypto/sha1.h"
 #include "crypto/aes128.h"
 #include "wsupp.h"
 #include "wsupp_crypto.h"
@@ -47,9 +46,12 @@ static int memxcmp(const void* av, const void* bv, size_t len)
 
        A | 0 | B | i
 
-   so there's no point in a dedicated buffer for B. */
+   so there's no point in a dedicated buffer for B.
 
-void PRF480(byte out[60], byte key[32], char* str,
+   The key is always the PSK, so the HMAC gets keyed in advance,
+   see prewarm_eapol(). */
+
+void PRF480(byte out[60], struct hmac_sha1* key, char* str,
             byte mac1[6], byte mac2[6],
             byte nonce1[32], byte nonce2[32])
 {
@@ -68,7 +70,7 @@ void PRF480(byte out[60], byte key[32], char* str,
 
 	for(int i = 0; i < 3; i++) {
 		*p = i;
-		hmac_sha1(out + i*20, key, 32, ibuf, ilen);
+		hmac_sha1_keyed(out + i*20, key, ibuf, ilen);
 	}
 }
 
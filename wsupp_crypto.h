@@ -1,6 +1,8 @@
 #include "common.h"
 
-void PRF480(byte out[60], byte key[32], char* str,
+struct hmac_sha1;
+
+void PRF480(byte out[60], struct hmac_sha1* key, char* str,
             byte mac1[6], byte mac2[6],
             byte nonce1[32], byte nonce2[32]);
 
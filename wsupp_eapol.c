@@ -2,6 +2,7 @@
 #include <netpacket/packet.h>
 #include <net/if.h>
 #include <sys/ioctl.h>
+#include <sys/random.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <string.h>
@@ -30,30 +31,10 @@
 #define ARPHRD_ETHER 1
 #define ETH_P_PAE 0x888E
 
-char* ifname;
-int ifindex;
-int rawsock;
+/* How long to wait for 1/4 after association, and for 3/4 after
+   sending 2/4, see handle_deadline() */
 
-int eapolstate;
-int eapolsends;
-
-static int version;
-byte amac[6]; /* A = authenticator (AP) */
-byte smac[6]; /* S = supplicant (client) */
-
-byte anonce[32];
-byte snonce[32];
-
-byte replay[8];
-
-byte PSK[32];
-
-byte KCK[16]; /* key check key, for computing MICs */
-byte KEK[16]; /* key encryption key, for AES unwrapping */
-byte PTK[16]; /* pairwise key (just TK in 802.11 terms) */
-byte GTK[32]; /* group temporary key */
-byte RSC[6];  /* ATTR_KEY_SEQ for GTK */
-int gtkindex;
+#define EAPOL_TIMEOUT 1000 /* ms */
 
 static char packet[1024];
 
@@ -66,33 +47,46 @@ static void send_group_2(void);
    re-open adn re-bind it. Otherwise, there's no problem with the socket
    remaining open across connection, so we do not bother closing it. */
 
-static void open_rawsock(void)
+static int open_rawsock(void)
 {
 	int type = htons(ETH_P_PAE);
 	int flags = SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC;
 	int fd;
 
-	if((fd = socket(AF_PACKET, flags, type)) < 0)
-		quit("socket AF_PACKET: %m\n");
+	if((fd = socket(AF_PACKET, flags, type)) < 0) {
+		warn("socket AF_PACKET: %m\n");
+		return -1;
+	}
 
 	struct sockaddr_ll addr = {
 		.sll_family = AF_PACKET,
-		.sll_ifindex = ifindex,
+		.sll_ifindex = ifc->ifindex,
 		.sll_protocol = type
 	};
 
-	if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
-		quit("bind AF_PACKET: %m\n");
+	if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		warn("bind AF_PACKET: %m\n");
+		close(fd);
+		return -1;
+	}
 
-	rawsock = fd;
+	ifc->rawsock = fd;
+
+	return 0;
 }
 
-void reopen_rawsock(void)
+int reopen_rawsock(void)
 {
-	if(rawsock >= 0)
-		return;
+	if(ifc->rawsock >= 0)
+		return 0;
+	if(ifc->opermode == OP_EXIT)
+		return -ENETDOWN;
+	if(open_rawsock() >= 0)
+		return 0;
 
-	open_rawsock();
+	drop_iface("cannot re-open EAPOL socket\n");
+
+	return -ENETDOWN;
 }
 
 void setup_iface(char* name)
@@ -110,8 +104,8 @@ void setup_iface(char* name)
 	if(ioctl(fd, SIOCGIFINDEX, &ifr) < 0)
 		fail("ioctl SIOCGIFINDEX %s: %m\n", name);
 
-	ifname = name;
-	ifindex = ifr.ifr_ifindex;
+	ifc->ifname = name;
+	ifc->ifindex = ifr.ifr_ifindex;
 
 	if(ioctl(fd, SIOCGIFHWADDR, &ifr) < 0)
 		fail("ioctl SIOCGIFHWADDR %s: %m\n", name);
@@ -119,9 +113,10 @@ void setup_iface(char* name)
 	if(ifr.ifr_addr.sa_family != ARPHRD_ETHER)
 		fail("unexpected hwaddr family on %s\n", name);
 
-	memcpy(smac, ifr.ifr_addr.sa_data, 6);
+	memcpy(ifc->smac, ifr.ifr_addr.sa_data, 6);
 
-	open_rawsock();
+	if(open_rawsock() < 0)
+		fail("cannot open EAPOL socket on %s\n", name);
 }
 
 /* The rest of the code deals with AP connection */
@@ -142,32 +137,32 @@ static void pmk_to_ptk()
 	uint8_t *mac1, *mac2;
 	uint8_t *nonce1, *nonce2;
 
-	memcpy(amac, ap.bssid, 6);
+	memcpy(ifc->amac, ifc->ap.bssid, 6);
 
-	if(memcmp(smac, amac, 6) < 0) {
-		mac1 = smac;
-		mac2 = amac;
+	if(memcmp(ifc->smac, ifc->amac, 6) < 0) {
+		mac1 = ifc->smac;
+		mac2 = ifc->amac;
 	} else {
-		mac1 = amac;
-		mac2 = smac;
+		mac1 = ifc->amac;
+		mac2 = ifc->smac;
 	}
 
-	if(memcmp(snonce, anonce, 32) < 0) {
-		nonce1 = snonce;
-		nonce2 = anonce;
+	if(memcmp(ifc->snonce, ifc->anonce, 32) < 0) {
+		nonce1 = ifc->snonce;
+		nonce2 = ifc->anonce;
 	} else {
-		nonce1 = anonce;
-		nonce2 = snonce;
+		nonce1 = ifc->anonce;
+		nonce2 = ifc->snonce;
 	}
 
 	uint8_t key[60];
 
 	char* astr = "Pairwise key expansion";
-	PRF480(key, PSK, astr, mac1, mac2, nonce1, nonce2);
+	PRF480(key, &ifc->pskhmac, astr, mac1, mac2, nonce1, nonce2);
 
-	memcpy(KCK, key +  0, 16);
-	memcpy(KEK, key + 16, 16);
-	memcpy(PTK, key + 32, 16);
+	memcpy(ifc->KCK, key +  0, 16);
+	memcpy(ifc->KEK, key + 16, 16);
+	memcpy(ifc->PTK, key + 32, 16);
 
 	memzero(key, sizeof(key));
 }
@@ -183,21 +178,21 @@ static const char kde_type_gtk[4] = { 0x00, 0x0F, 0xAC, 0x01 };
 
 static int store_gtk(int idx, byte* buf, int len)
 {
-	int explen = ap.tkipgroup ? 32 : 16;
+	int explen = ifc->ap.tkipgroup ? 32 : 16;
 
 	if(len != explen)
 		return -1;
 
-	gtkindex = idx;
+	ifc->gtkindex = idx;
 
-	memcpy(GTK, buf, 16);
+	memcpy(ifc->GTK, buf, 16);
 
 	/* From wpa_supplicant: swap Tx/Rx for Michael MIC.
 	   No idea where this comes from, but it's necessary
 	   to get the right key. */
-	if(ap.tkipgroup) {
-		memcpy(GTK + 16, buf + 24, 8);
-		memcpy(GTK + 24, buf + 16, 8);
+	if(ifc->ap.tkipgroup) {
+		memcpy(ifc->GTK + 16, buf + 24, 8);
+		memcpy(ifc->GTK + 24, buf + 16, 8);
 	}
 
 	return 0;
@@ -239,9 +234,43 @@ static int fetch_gtk(char* buf, int len)
 	return -1;
 }
 
+/* SNonces get taken from a small pool, so that replying to 1/4 does not
+   have to wait on the random source. The pool gets refilled ahead of
+   each connection attempt. */
+
+static void refill_nonces(void)
+{
+	int need = NNONCES - ifc->nnonces;
+	byte* buf = ifc->nonces[ifc->nnonces];
+	long rd;
+
+	if(need <= 0)
+		return;
+	if((rd = getrandom(buf, need*32, GRND_NONBLOCK)) < 0)
+		return;
+
+	ifc->nnonces += rd/32;
+}
+
+static int take_nonce(void)
+{
+	if(ifc->nnonces <= 0)
+		return -1;
+
+	ifc->nnonces--;
+
+	memcpy(ifc->snonce, ifc->nonces[ifc->nnonces], sizeof(ifc->snonce));
+	memzero(ifc->nonces[ifc->nnonces], sizeof(ifc->snonce));
+
+	return 0;
+}
+
 static void fill_rand(void)
 {
-	int rlen = sizeof(snonce);
+	if(!take_nonce())
+		return;
+
+	int rlen = sizeof(ifc->snonce);
 	char rand[rlen];
 
 	long fd, rd;
@@ -256,16 +285,16 @@ static void fill_rand(void)
 
 	close(fd);
 
-	memcpy(snonce, rand, sizeof(snonce));
+	memcpy(ifc->snonce, rand, sizeof(ifc->snonce));
 }
 
 static void cleanup_keys(void)
 {
 	memzero(packet, sizeof(packet));
-	memzero(anonce, sizeof(anonce));
-	memzero(snonce, sizeof(snonce));
-	memzero(PTK, sizeof(PTK));
-	memzero(GTK, sizeof(GTK));
+	memzero(ifc->anonce, sizeof(ifc->anonce));
+	memzero(ifc->snonce, sizeof(ifc->snonce));
+	memzero(ifc->PTK, sizeof(ifc->PTK));
+	memzero(ifc->GTK, sizeof(ifc->GTK));
 	/* we may need KCK and KEK for GTK rekeying */
 }
 
@@ -273,15 +302,34 @@ void reset_eapol_state(void)
 {
 	cleanup_keys();
 
-	memzero(KCK, sizeof(KCK));
-	memzero(GTK, sizeof(GTK));
-	memzero(KEK, sizeof(KEK));
+	memzero(ifc->KCK, sizeof(ifc->KCK));
+	memzero(ifc->GTK, sizeof(ifc->GTK));
+	memzero(ifc->KEK, sizeof(ifc->KEK));
+
+	memzero(ifc->snonce, sizeof(ifc->snonce));
+	memzero(ifc->anonce, sizeof(ifc->anonce));
+	memzero(ifc->amac, sizeof(ifc->amac));
+	memzero(&ifc->pskhmac, sizeof(ifc->pskhmac));
+
+	ifc->version = 0;
+}
+
+/* The keyed HMAC state is as good as the PSK itself. */
 
-	memzero(snonce, sizeof(snonce));
-	memzero(anonce, sizeof(anonce));
-	memzero(amac, sizeof(amac));
+void wipe_psk(void)
+{
+	memzero(ifc->PSK, sizeof(ifc->PSK));
+	memzero(&ifc->pskhmac, sizeof(ifc->pskhmac));
+}
 
-	version = 0;
+/* Everything that does not depend on the AP's reply gets done before
+   the connection attempt starts, leaving only PRF finalization and MIC
+   between 1/4 and 2/4. The PSK is known by this point, see set_current_ap(). */
+
+void prewarm_eapol(void)
+{
+	hmac_sha1_key(&ifc->pskhmac, ifc->PSK, sizeof(ifc->PSK));
+	refill_nonces();
 }
 
 /* The tricky part here. EAPOL packet 1/4 may arrive before the ASSOCIATE msg
@@ -299,29 +347,31 @@ void reset_eapol_state(void)
 
 void prime_eapol_state(void)
 {
-	eapolstate = ES_WAITING_1_4;
-	eapolsends = 0;
+	ifc->eapolstate = ES_WAITING_1_4;
+	ifc->eapolsends = 0;
 }
 
 void allow_eapol_sends(void)
 {
-	if(eapolstate == ES_WAITING_1_4)
-		eapolsends = 1;
-	else
+	if(ifc->eapolstate == ES_WAITING_1_4) {
+		ifc->eapolsends = 1;
+		set_deadline(EAPOL_TIMEOUT);
+	} else {
 		send_packet_2();
+	}
 }
 
 static int send_packet(char* buf, int len)
 {
-	int fd = rawsock;
+	int fd = ifc->rawsock;
 	struct sockaddr_ll dest;
 	long wr;
 
 	memzero(&dest, sizeof(dest));
 	dest.sll_family = AF_PACKET;
 	dest.sll_protocol = htons(ETH_P_PAE);
-	dest.sll_ifindex = ifindex;
-	memcpy(dest.sll_addr, amac, 6);
+	dest.sll_ifindex = ifc->ifindex;
+	memcpy(dest.sll_addr, ifc->amac, 6);
 
 	if((wr = sendto(fd, buf, len, 0, (struct sockaddr*)&dest, sizeof(dest))) < 0)
 		warn("send: %m\n");
@@ -358,17 +408,17 @@ static void recv_packet_1(struct eapolkey* ek)
 	if(!ptype(ek, KI_PAIRWISE | KI_ACK))
 		return ignore("packet 1/4 wrong bits");
 
-	version = ek->version;
-	memcpy(anonce, ek->nonce, sizeof(anonce));
-	memcpy(replay, ek->replay, sizeof(replay));
+	ifc->version = ek->version;
+	memcpy(ifc->anonce, ek->nonce, sizeof(ifc->anonce));
+	memcpy(ifc->replay, ek->replay, sizeof(ifc->replay));
 
 	fill_rand();
 	pmk_to_ptk();
 
-	if(eapolsends)
+	if(ifc->eapolsends)
 		return send_packet_2();
 	else
-		eapolstate = ES_WAITING_2_4;
+		ifc->eapolstate = ES_WAITING_2_4;
 }
 
 /* Packet 2/4 must carry IEs, the same ones we've sent already
@@ -383,32 +433,55 @@ static void send_packet_2(void)
 {
 	struct eapolkey* ek = (struct eapolkey*) packet;
 
-	ek->version = version;
+	ek->version = ifc->version;
 	ek->pactype = EAPOL_KEY;
 	ek->type = EAPOL_KEY_RSN;
 	ek->keyinfo = htons(KI_SHA | KI_PAIRWISE | KI_MIC);
 	ek->keylen = htons(16);
-	memcpy(ek->replay, replay, sizeof(replay));
-	memcpy(ek->nonce, snonce, sizeof(snonce));
+	memcpy(ek->replay, ifc->replay, sizeof(ifc->replay));
+	memcpy(ek->nonce, ifc->snonce, sizeof(ifc->snonce));
 	memzero(ek->iv, sizeof(ek->iv));
 	memzero(ek->rsc, sizeof(ek->rsc));
 	memzero(ek->mic, sizeof(ek->mic));
 	memzero(ek->_reserved, sizeof(ek->_reserved));
 
-	const char* payload = ap.ies;
-	int paylen = ap.iesize;
+	const char* payload = ifc->ap.ies;
+	int paylen = ifc->ap.iesize;
 	int paclen = sizeof(*ek) + paylen;
 
 	ek->paylen = htons(paylen);
 	ek->paclen = htons(paclen - 4);
 	memcpy(ek->payload, payload, paylen);
 
-	make_mic(ek->mic, KCK, packet, paclen);
+	make_mic(ek->mic, ifc->KCK, packet, paclen);
 
 	if(send_packet(packet, paclen))
 		return;
 
-	eapolstate = ES_WAITING_3_4;
+	ifc->eapolstate = ES_WAITING_3_4;
+	set_deadline(EAPOL_TIMEOUT);
+}
+
+/* Lossy links. If 2/4 gets lost, the AP sends 1/4 again, with a higher
+   replay counter. The reply is another 2/4 with the same SNonce. ANonce
+   should stay the same as well, but if it does not, PTK gets re-derived
+   since it depends on both. */
+
+static void resend_packet_2(struct eapolkey* ek)
+{
+	if(ek->type != EAPOL_KEY_RSN)
+		return ignore("packet 1/4 wrong type");
+	if(memcmp(ifc->replay, ek->replay, sizeof(ifc->replay)) >= 0)
+		return ignore("packet 1/4 replay");
+
+	memcpy(ifc->replay, ek->replay, sizeof(ifc->replay));
+
+	if(memcmp(ifc->anonce, ek->nonce, sizeof(ifc->anonce))) {
+		memcpy(ifc->anonce, ek->nonce, sizeof(ifc->anonce));
+		pmk_to_ptk();
+	}
+
+	send_packet_2();
 }
 
 static void recv_packet_3(struct eapolkey* ek)
@@ -417,41 +490,41 @@ static void recv_packet_3(struct eapolkey* ek)
 	int paclen = 4 + ntohs(ek->paclen);
 
 	if(ptype(ek, KI_PAIRWISE | KI_ACK))
-		return xabort("packet 1/4 resend detected");
+		return resend_packet_2(ek);
 	if(!ptype(ek, KI_PAIRWISE | KI_ACK | KI_MIC | KI_ENCRYPTED | KI_SECURE))
 		return xabort("packet 3/4 wrong bits");
 
-	if(memcmp(anonce, ek->nonce, sizeof(anonce)))
+	if(memcmp(ifc->anonce, ek->nonce, sizeof(ifc->anonce)))
 		return xabort("packet 3/4 nonce changed");
-	if(memcmp(replay, ek->replay, sizeof(replay)) >= 0)
+	if(memcmp(ifc->replay, ek->replay, sizeof(ifc->replay)) >= 0)
 		return xabort("packet 3/4 replay fail");
-	if(check_mic(ek->mic, KCK, pacbuf, paclen))
+	if(check_mic(ek->mic, ifc->KCK, pacbuf, paclen))
 		return xabort("packet 3/4 bad MIC");
 
 	char* payload = ek->payload;
 	int paylen = ntohs(ek->paylen);
 
-	if(unwrap_key(KEK, payload, paylen))
+	if(unwrap_key(ifc->KEK, payload, paylen))
 		return xabort("packet 3/4 cannot unwrap");
 	if(fetch_gtk(payload + 8, paylen - 8))
 		return xabort("packet 3/4 cannot fetch GTK");
 
-	memcpy(RSC, ek->rsc, 6); /* it's 8 bytes but only 6 are used */
-	memcpy(replay, ek->replay, sizeof(replay));
+	memcpy(ifc->RSC, ek->rsc, 6); /* it's 8 bytes but only 6 are used */
+	memcpy(ifc->replay, ek->replay, sizeof(ifc->replay));
 
 	return send_packet_4();
 }
 
-static void send_packet_4(void)
+static int send_ack_4(void)
 {
 	struct eapolkey* ek = (struct eapolkey*) packet;
 
-	ek->version = version;
+	ek->version = ifc->version;
 	ek->pactype = 3;
 	ek->type = 2;
 	ek->keyinfo = htons(KI_SHA | KI_PAIRWISE | KI_MIC | KI_SECURE);
 	ek->keylen = 0;
-	memcpy(ek->replay, replay, sizeof(replay));
+	memcpy(ek->replay, ifc->replay, sizeof(ifc->replay));
 	memzero(ek->nonce, sizeof(ek->nonce));
 	memzero(ek->iv, sizeof(ek->iv));
 	memzero(ek->rsc, sizeof(ek->rsc));
@@ -463,27 +536,55 @@ static void send_packet_4(void)
 	ek->paylen = htons(0);
 	ek->paclen = htons(paclen - 4);
 
-	make_mic(ek->mic, KCK, packet, paclen);
+	make_mic(ek->mic, ifc->KCK, packet, paclen);
 
-	if(send_packet(packet, paclen))
+	return send_packet(packet, paclen);
+}
+
+static void send_packet_4(void)
+{
+	if(send_ack_4())
 		return;
 
-	eapolstate = ES_NEGOTIATED;
+	ifc->eapolstate = ES_NEGOTIATED;
+	clr_deadline();
 
 	upload_ptk();
 	upload_gtk();
+	upload_rekey_data();
 	cleanup_keys();
 
 	handle_connect();
 }
 
+/* If 4/4 gets lost, the AP sends 3/4 again. The keys are in place
+   by then, so all there is to do is to repeat 4/4. ANonce is gone
+   at this point, but the KCK is still there, and a good MIC is enough
+   to tell the packet is genuine. */
+
+static void recv_packet_3_again(struct eapolkey* ek)
+{
+	char* pacbuf = (char*)ek;
+	int paclen = 4 + ntohs(ek->paclen);
+
+	if(memcmp(ifc->replay, ek->replay, sizeof(ifc->replay)) >= 0)
+		return ignore("packet 3/4 replay");
+	if(check_mic(ek->mic, ifc->KCK, pacbuf, paclen))
+		return ignore("packet 3/4 bad MIC");
+
+	memcpy(ifc->replay, ek->replay, sizeof(ifc->replay));
+
+	send_ack_4();
+}
+
 /* Group rekey packets may arrive at any time, and they are the only
    reason to keep rawsock open past the initial key negotiations.
    The AP decides when to send them, typically once in N hours.
 
    Because of the way dispatch() below works, any EAPOL packets
    arriving after packet 4/4 has been sent will be treated as
-   group rekey request, and rejected if they don't look like one. */
+   group rekey request or a resent 3/4, and rejected if they don't
+   look like either. */
 
 static void recv_group_1(struct eapolkey* ek)
 {
@@ -492,23 +593,25 @@ static void recv_group_1(struct eapolkey* ek)
 
 	if(ek->type != EAPOL_KEY_RSN)
 		return ignore("re-keying with a different key type");
+	if(ptype(ek, KI_PAIRWISE | KI_ACK | KI_MIC | KI_ENCRYPTED | KI_SECURE))
+		return recv_packet_3_again(ek);
 	if(!ptype(ek, KI_SECURE | KI_ENCRYPTED | KI_ACK | KI_MIC))
 		return ignore("not a rekey request packet");
-	if(memcmp(replay, ek->replay, sizeof(replay)) >= 0)
+	if(memcmp(ifc->replay, ek->replay, sizeof(ifc->replay)) >= 0)
 		return ignore("packet 1/2 replay");
-	if(check_mic(ek->mic, KCK, pacbuf, paclen))
+	if(check_mic(ek->mic, ifc->KCK, pacbuf, paclen))
 		return ignore("packet 1/2 bad MIC");
 
 	char* payload = ek->payload;
 	int paylen = ntohs(ek->paylen);
 
-	if(unwrap_key(KEK, payload, paylen))
+	if(unwrap_key(ifc->KEK, payload, paylen))
 		return xabort("packet 1/2 cannot unwrap");
 	if(fetch_gtk(payload + 8, paylen - 8))
 		return xabort("packet 1/2 cannot fetch GTK");
 
-	memcpy(RSC, ek->rsc, 6); /* it's 8 bytes but only 6 are used */
-	memcpy(replay, ek->replay, sizeof(replay));
+	memcpy(ifc->RSC, ek->rsc, 6); /* it's 8 bytes but only 6 are used */
+	memcpy(ifc->replay, ek->replay, sizeof(ifc->replay));
 
 	return send_group_2();
 }
@@ -517,13 +620,13 @@ void send_group_2(void)
 {
 	struct eapolkey* ek = (struct eapolkey*) packet;
 
-	ek->version = version;
+	ek->version = ifc->version;
 	ek->pactype = 3;
 	ek->type = 2;
 	ek->keyinfo = htons(KI_MIC | KI_SECURE);
 	ek->keylen = 0;
-	memcpy(ek->replay, replay, sizeof(replay));
-	memzero(ek->nonce, sizeof(snonce));
+	memcpy(ek->replay, ifc->replay, sizeof(ifc->replay));
+	memzero(ek->nonce, sizeof(ifc->snonce));
 	memzero(ek->iv, sizeof(ek->iv));
 	memzero(ek->rsc, sizeof(ek->rsc));
 	memzero(ek->mic, sizeof(ek->mic));
@@ -534,18 +637,59 @@ void send_group_2(void)
 	ek->paylen = htons(0);
 	ek->paclen = htons(paclen);
 
-	make_mic(ek->mic, KCK, packet, paclen);
+	make_mic(ek->mic, ifc->KCK, packet, paclen);
 
 	if(send_packet(packet, paclen))
 		return;
 
 	upload_gtk();
+	upload_rekey_data();
+}
+
+/* Group rekey done by the card, see cmd_rekey_offload(). Our copy
+   of the GTK is stale now, and the card has the current one. */
+
+void sync_rekey_state(byte ctr[8])
+{
+	if(ifc->eapolstate != ES_NEGOTIATED)
+		return;
+	if(memcmp(ifc->replay, ctr, sizeof(ifc->replay)) >= 0)
+		return;
+
+	memcpy(ifc->replay, ctr, sizeof(ifc->replay));
+	memzero(ifc->GTK, sizeof(ifc->GTK));
+}
+
+/* Hitless restart, see wsupp_link.c. PTK and GTK are already installed
+   in the card, only the keys needed for group rekeys get carried over. */
+
+void stash_eapol_state(struct eapolctx* ec)
+{
+	memcpy(ec->kck, ifc->KCK, sizeof(ifc->KCK));
+	memcpy(ec->kek, ifc->KEK, sizeof(ifc->KEK));
+	memcpy(ec->replay, ifc->replay, sizeof(ifc->replay));
+	ec->gtkindex = ifc->gtkindex;
+	ec->version = ifc->version;
+}
+
+void adopt_eapol_state(struct eapolctx* ec)
+{
+	memcpy(ifc->KCK, ec->kck, sizeof(ifc->KCK));
+	memcpy(ifc->KEK, ec->kek, sizeof(ifc->KEK));
+	memcpy(ifc->replay, ec->replay, sizeof(ifc->replay));
+	memcpy(ifc->amac, ifc->ap.bssid, 6);
+	ifc->gtkindex = ec->gtkindex;
+	ifc->version = ec->version;
+
+	ifc->eapolstate = ES_NEGOTIATED;
+	ifc->eapolsends = 1;
 }
 
 static void dispatch(struct eapolkey* ek)
 {
-	switch(eapolstate) {
+	switch(ifc->eapolstate) {
 		case ES_WAITING_1_4: return recv_packet_1(ek);
+		case ES_WAITING_2_4: return recv_packet_1(ek); /* resent 1/4 */
 		case ES_WAITING_3_4: return recv_packet_3(ek);
 		case ES_NEGOTIATED: return recv_group_1(ek);
 		default: return ignore("unexpected packet");
@@ -557,13 +701,13 @@ void handle_rawsock(void)
 	struct sockaddr_ll sender;
 	int psize = sizeof(packet);
 	unsigned asize = sizeof(sender);
-	int fd = rawsock;
+	int fd = ifc->rawsock;
 	int rd;
 
 	if((rd = recvfrom(fd, packet, psize, 0, (struct sockaddr*)&sender, &asize)) < 0)
 		return warn("EAPOL: %m\n");
 
-	if(memcmp(ap.bssid, sender.sll_addr, 6))
+	if(memcmp(ifc->ap.bssid, sender.sll_addr, 6))
 		return warn("EAPOL stray packet\n");
 
 	struct eapolkey* ek = (struct eapolkey*) packet;
@@ -0,0 +1,126 @@
+#include <string.h>
+
+#include "common.h"
+#include "wsupp.h"
+
+/* Per-BSSID failure records. SF_TRIED only lasts until the next
+   reset_scan_counters() or successful connection, after which an AP
+   that keeps failing (say, one radio with a different PSK, or an AP
+   rejecting associations) would be tried again on every cycle, each
+   attempt taking a full auth/assoc/EAPOL timeout.
+
+   Instead, each failure backs the BSSID off for a while, doubling with
+   each consecutive failure, and AP selection skips it until the backoff
+   expires. The records are kept apart from the scan list so that they
+   survive scan refreshes. A successful connection clears the record. */
+
+#define NFAILS 32
+#define BACKOFF_MAX 10*60
+#define FAIL_FORGET 30*60
+
+struct fail {
+	byte bssid[6];
+	byte phase; /* authstate at the time of failure */
+	byte count;
+	int until;  /* uptime() */
+};
+
+static struct fail fails[NFAILS];
+
+static struct fail* find_fail(byte bssid[6])
+{
+	struct fail* fl;
+
+	for(fl = fails; fl < fails + NFAILS; fl++)
+		if(fl->count && !memcmp(fl->bssid, bssid, 6))
+			return fl;
+
+	return NULL;
+}
+
+/* With no free slots, the record that expired first gets replaced. */
+
+static struct fail* grab_fail(byte bssid[6])
+{
+	struct fail* fl;
+	struct fail* oldest = fails;
+
+	if((fl = find_fail(bssid)))
+		return fl;
+
+	for(fl = fails; fl < fails + NFAILS; fl++)
+		if(!fl->count)
+			break;
+		else if(fl->until < oldest->until)
+			oldest = fl;
+
+	if(fl >= fails + NFAILS)
+		fl = oldest;
+
+	memzero(fl, sizeof(*fl));
+	memcpy(fl->bssid, bssid, 6);
+
+	return fl;
+}
+
+/* Failing EAPOL usually means a bad PSK for this particular AP,
+   which is not going to fix itself quickly. Auth and assoc failures
+   are more often transient. */
+
+static int backoff_base(int phase)
+{
+	if(phase == AS_CONNECTING)
+		return 30;
+	else
+		return 5;
+}
+
+void note_failure(byte bssid[6], int phase)
+{
+	struct fail* fl;
+	int now = uptime();
+	int delay;
+
+	if(phase < AS_AUTHENTICATING || phase > AS_CONNECTING)
+		return;
+
+	hist_failure(bssid);
+
+	fl = grab_fail(bssid);
+
+	if(now - fl->until > FAIL_FORGET)
+		fl->count = 0;
+	if(fl->count < 255)
+		fl->count++;
+
+	delay = backoff_base(phase) << (fl->count < 8 ? fl->count - 1 : 7);
+
+	if(delay > BACKOFF_MAX)
+		delay = BACKOFF_MAX;
+
+	fl->phase = phase;
+	fl->until = now + delay;
+}
+
+void clear_failures(byte bssid[6])
+{
+	struct fail* fl;
+
+	if((fl = find_fail(bssid)))
+		memzero(fl, sizeof(*fl));
+}
+
+/* Returns the time the backoff expires, or 0 if the BSSID
+   is not backed off at the moment. */
+
+int backoff_until(byte bssid[6])
+{
+	struct fail* fl;
+
+	if(!(fl = find_fail(bssid)))
+		return 0;
+	if(fl->until <= uptime())
+		return 0;
+
+	return fl->until;
+}
@@ -0,0 +1,304 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "common.h"
+#include "control.h"
+#include "wsupp.h"
+
+/* Connection history, per BSSID. Some APs look great on signal but take
+   ages to connect to, or keep dropping clients every few minutes, and
+   there's no way to tell other than by remembering how it went before.
+
+   For each BSSID we keep the success rate of connection attempts,
+   the recent times to connect, the average session length, how often
+   and why the AP dropped us, and the average signal while connected.
+   The table is small and gets saved to disk, see load_history().
+
+   Counters get halved once they grow large enough, so that the history
+   reflects the recent behavior of the AP. */
+
+#define NHIST 64
+#define NTIMES 5
+#define DECAY_AT 32
+
+#define HIST_MAGIC 0x31534857 /* "WHS1" */
+#define HIST_INTERVAL 5*60
+
+struct hist {
+	byte bssid[6];
+	ushort tidx;
+	ushort attempts;
+	ushort successes;
+	ushort sessions;
+	ushort drops;  /* sessions ended by the AP */
+	ushort reason; /* last disconnect reason */
+	short signal;  /* average while connected, mBm */
+	ushort times[NTIMES]; /* time to connect, ms */
+	int session;   /* average session length, s */
+	uint64_t used; /* wallclock() */
+};
+
+struct histhdr {
+	uint32_t magic;
+	uint16_t size;
+	uint16_t count;
+};
+
+static struct hist hists[NHIST];
+static int modified;
+static int savedtime;
+
+static struct hist* find_hist(byte bssid[6])
+{
+	struct hist* hs;
+
+	for(hs = hists; hs < hists + NHIST; hs++)
+		if(hs->used && !memcmp(hs->bssid, bssid, 6))
+			return hs;
+
+	return NULL;
+}
+
+static struct hist* grab_hist(byte bssid[6])
+{
+	struct hist* hs;
+	struct hist* lru = hists;
+
+	if((hs = find_hist(bssid)))
+		goto out;
+
+	for(hs = hists; hs < hists + NHIST; hs++)
+		if(!hs->used)
+			break;
+		else if(hs->used < lru->used)
+			lru = hs;
+
+	if(hs >= hists + NHIST)
+		hs = lru;
+
+	memzero(hs, sizeof(*hs));
+	memcpy(hs->bssid, bssid, 6);
+out:
+	hs->used = wallclock();
+	modified = 1;
+
+	return hs;
+}
+
+static void count_attempt(struct hist* hs, int success)
+{
+	if(hs->attempts >= DECAY_AT) {
+		hs->attempts /= 2;
+		hs->successes /= 2;
+	}
+
+	hs->attempts++;
+
+	if(success)
+		hs->successes++;
+}
+
+static int average(int avg, int val, int count)
+{
+	if(count <= 1)
+		return val;
+
+	return (3*avg + val)/4;
+}
+
+void hist_attempt(void)
+{
+	ifc->attempt = uptime_ms();
+}
+
+void hist_failure(byte bssid[6])
+{
+	struct hist* hs = grab_hist(bssid);
+
+	count_attempt(hs, 0);
+
+	rerank_bssid(bssid);
+}
+
+void hist_connected(byte bssid[6], int signal)
+{
+	struct hist* hs = grab_hist(bssid);
+	uint64_t took = uptime_ms() - ifc->attempt;
+
+	count_attempt(hs, 1);
+
+	if(ifc->attempt && took < 0xFFFF) {
+		hs->times[hs->tidx] = took;
+		hs->tidx = (hs->tidx + 1) % NTIMES;
+	}
+
+	if(hs->sessions >= DECAY_AT) {
+		hs->sessions /= 2;
+		hs->drops /= 2;
+	}
+
+	hs->sessions++;
+
+	if(signal)
+		hs->signal = average(hs->signal, signal, hs->sessions);
+
+	ifc->connected = uptime();
+	ifc->attempt = 0;
+
+	rerank_bssid(bssid);
+}
+
+/* A link taken over from a previous instance of wsupp, see adopt_link().
+   The attempt has been counted already, only the session starts anew. */
+
+void hist_adopted(byte bssid[6])
+{
+	grab_hist(bssid);
+
+	ifc->connected = uptime();
+	ifc->attempt = 0;
+}
+
+void hist_signal(byte bssid[6], int signal)
+{
+	struct hist* hs;
+
+	if(!ifc->connected || !(hs = find_hist(bssid)))
+		return;
+
+	hs->signal = average(hs->signal, signal, 2);
+	modified = 1;
+}
+
+void hist_disconnected(byte bssid[6], int reason, int byap)
+{
+	struct hist* hs;
+	int session;
+
+	if(!ifc->connected)
+		return;
+
+	hs = grab_hist(bssid);
+	session = uptime() - ifc->connected;
+
+	hs->session = average(hs->session, session, hs->sessions);
+	hs->reason = reason;
+
+	if(byap)
+		hs->drops++;
+
+	ifc->connected = 0;
+
+	rerank_bssid(bssid);
+}
+
+static int median_time(struct hist* hs)
+{
+	int t[NTIMES];
+	int i, j, n = 0, v;
+
+	for(i = 0; i < NTIMES; i++) {
+		if(!(v = hs->times[i]))
+			continue;
+		for(j = n++; j > 0 && t[j-1] > v; j--)
+			t[j] = t[j-1];
+		t[j] = v;
+	}
+
+	return n ? t[n/2] : 0;
+}
+
+/* Multiplier for the throughput estimate, in percent. Unknown APs get
+   75, so that an AP with a good record beats an unknown one, and an AP
+   that keeps failing or dropping us ranks below both. */
+
+int hist_score(byte bssid[6])
+{
+	struct hist* hs;
+	int score;
+
+	if(!(hs = find_hist(bssid)))
+		return 75;
+
+	score = 50 + 50*(hs->successes + 1)/(hs->attempts + 2);
+
+	if(hs->sessions >= 2 && hs->drops*2 >= hs->sessions && hs->session < 10*60)
+		score = score*(50 + 50*hs->session/(10*60))/100;
+	if(median_time(hs) > 2000)
+		score -= 10;
+
+	return score;
+}
+
+/* Same approach as with the scan list snapshot in wsupp_state.c,
+   except that history is worth keeping for a long time, so there's
+   no age limit. */
+
+void load_history(void)
+{
+	struct histhdr hh;
+	int fd, size, rd;
+
+	if((fd = open(WIHIST, O_RDONLY)) < 0)
+		return;
+	if(read(fd, &hh, sizeof(hh)) != sizeof(hh))
+		goto out;
+	if(hh.magic != HIST_MAGIC || hh.size != sizeof(struct hist))
+		goto out;
+	if(hh.count > NHIST)
+		goto out;
+
+	size = hh.count*sizeof(struct hist);
+
+	if((rd = read(fd, hists, size)) != size)
+		memzero(hists, sizeof(hists));
+out:
+	close(fd);
+}
+
+void save_history(void)
+{
+	struct histhdr hh;
+	struct hist* hs;
+	char tmp[] = WIHIST ".tmp";
+	int fd, ret;
+
+	if(!modified)
+		return;
+	if((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0)
+		return;
+
+	memzero(&hh, sizeof(hh));
+	hh.magic = HIST_MAGIC;
+	hh.size = sizeof(struct hist);
+
+	for(hs = hists; hs < hists + NHIST; hs++)
+		if(hs->used) hh.count++;
+
+	if((ret = writeall(fd, &hh, sizeof(hh))) < 0)
+		goto out;
+
+	for(hs = hists; hs < hists + NHIST; hs++)
+		if(!hs->used)
+			continue;
+		else if((ret = writeall(fd, hs, sizeof(*hs))) < 0)
+			goto out;
+out:
+	if(commit_tmp(fd, tmp, WIHIST, ret) < 0)
+		return;
+
+	modified = 0;
+	savedtime = uptime();
+}
+
+void sync_history(void)
+{
+	if(!modified)
+		return;
+	if(uptime() - savedtime < HIST_INTERVAL)
+		return;
+
+	save_history();
+}
@@ -7,33 +7,46 @@
 #include "common.h"
 #include "wsupp.h"
 
-static int dhcpid;
-
 void kill_dhcp(void)
 {
-	if(dhcpid <= 0)
+	if(ifc->dhcpid <= 0)
 		return;
 
-	kill(dhcpid, SIGTERM);
+	kill(ifc->dhcpid, SIGTERM);
 }
 
-void reap_dhcp(void)
+static void reap(int pid, int status)
 {
-	int pid, status;
+	struct iface* fi;
 
-	if((pid = waitpid(-1, &status, WNOHANG)) <= 0)
-		return;
-	if(pid != dhcpid)
+	for(fi = ifaces; fi < ifaces + nifaces; fi++)
+		if(fi->dhcpid == pid)
+			break;
+	if(fi >= ifaces + nifaces)
 		return;
 
-	dhcpid = 0;
+	fi->dhcpid = 0;
 
 	if(!status)
 		return;
 	if(WIFEXITED(status))
-		warn("dhcp failed with code %i\n", WEXITSTATUS(status));
+		warn("dhcp on %s failed with code %i\n",
+				fi->ifname, WEXITSTATUS(status));
 	if(WIFSIGNALED(status))
-		warn("dhcp killed by signal %i\n", WTERMSIG(status));
+		warn("dhcp on %s killed by signal %i\n",
+				fi->ifname, WTERMSIG(status));
+}
+
+/* Called from the signal handler, which may be running in the middle
+   of handling some other interface, so ifc is left alone here. Several
+   children may exit before SIGCHLD gets delivered. */
+
+void reap_dhcp(void)
+{
+	int pid, status;
+
+	while((pid = waitpid(-1, &status, WNOHANG)) > 0)
+		reap(pid, status);
 }
 
 void trigger_dhcp(void)
@@ -46,12 +59,12 @@ void trigger_dhcp(void)
 		fail("fork: %m\n");
 
 	if(pid == 0) {
-		char* argv[] = { "dhcp", ifname, NULL };
+		char* argv[] = { "dhcp", ifc->ifname, NULL };
 
 		execv(*argv, argv);
 
 		fail("exec %s: %m\n", *argv);
 	}
 
-	dhcpid = pid;
+	ifc->dhcpid = pid;
 }
@@ -0,0 +1,230 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "common.h"
+#include "control.h"
+
+#include "netlink.h"
+#include "netlink/genl.h"
+#include "netlink/genl/nl80211.h"
+
+#include "wsupp.h"
+
+/* Hitless restart. On SIGHUP, a connected wsupp saves whatever it needs
+   to keep the link going, and exits without disconnecting. The next
+   instance checks that the interface is still associated with the same
+   AP, and if so, takes over the link instead of starting from scratch.
+   The link stays up through the restart, and group rekeys keep working.
+
+   The file holds live keys, so it is private to root, and it goes to
+   /run because the association does not survive a reboot anyway.
+   It gets removed as soon as it's been read. */
+
+#define LINK_MAGIC 0x314B4C57 /* "WLK1" */
+#define LINK_MAX_AGE 60
+
+struct linkstate {
+	uint32_t magic;
+	uint16_t size;
+	uint16_t slen;
+	uint64_t time;
+	int ifindex;
+	byte bssid[6];
+	short freq;
+	short type;
+	byte ssid[SSIDLEN];
+	struct eapolctx ec;
+};
+
+extern struct netlink nl;
+extern int nl80211;
+
+int save_link_state(void)
+{
+	struct linkstate ls;
+	char path[PATHLEN], tmp[PATHLEN];
+	int fd, ret;
+
+	iface_path(path, sizeof(path), WILINK, "");
+	iface_path(tmp, sizeof(tmp), WILINK, ".tmp");
+
+	if((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0)
+		return -1;
+
+	memzero(&ls, sizeof(ls));
+	ls.magic = LINK_MAGIC;
+	ls.size = sizeof(ls);
+	ls.time = wallclock();
+	ls.ifindex = ifc->ifindex;
+	memcpy(ls.bssid, ifc->ap.bssid, 6);
+	ls.freq = ifc->ap.freq;
+	ls.type = ifc->ap.type;
+	ls.slen = ifc->ap.slen;
+	memcpy(ls.ssid, ifc->ap.ssid, ifc->ap.slen);
+
+	stash_eapol_state(&ls.ec);
+
+	ret = writeall(fd, &ls, sizeof(ls));
+	ret = commit_tmp(fd, tmp, path, ret);
+
+	memzero(&ls, sizeof(ls));
+
+	return ret;
+}
+
+static int load_link_state(struct linkstate* ls)
+{
+	uint64_t now = wallclock();
+	char path[PATHLEN];
+	int fd, rd;
+
+	iface_path(path, sizeof(path), WILINK, "");
+
+	if((fd = open(path, O_RDONLY)) < 0)
+		return -1;
+
+	rd = read(fd, ls, sizeof(*ls));
+
+	close(fd);
+	unlink(path);
+
+	if(rd != sizeof(*ls))
+		return -1;
+	if(ls->magic != LINK_MAGIC || ls->size != sizeof(*ls))
+		return -1;
+	if(ls->ifindex != ifc->ifindex)
+		return -1;
+	if(ls->time > now || now - ls->time > LINK_MAX_AGE)
+		return -1;
+	if(ls->slen > SSIDLEN)
+		return -1;
+
+	return 0;
+}
+
+/* The kernel reports the SSID for connected station interfaces only.
+   The channel may have changed since the last instance exited. */
+
+static int check_interface(struct linkstate* ls)
+{
+	struct nlgen* msg;
+	struct nlattr* at;
+	uint32_t* freq;
+
+	nl_new_cmd(&nl, nl80211, NL80211_CMD_GET_INTERFACE, 0);
+	nl_put_u32(&nl, NL80211_ATTR_IFINDEX, ifc->ifindex);
+
+	if(!(msg = nl_send_recv_genl(&nl)))
+		return -1;
+	if(!(at = nl_get(msg, NL80211_ATTR_SSID)))
+		return -1;
+	if(nl_attr_len(at) != ls->slen)
+		return -1;
+	if(memcmp(at->payload, ls->ssid, ls->slen))
+		return -1;
+
+	if((freq = nl_get_u32(msg, NL80211_ATTR_WIPHY_FREQ)))
+		ls->freq = *freq;
+
+	return 0;
+}
+
+/* The AP must still be there, and the port open, which means
+   the keys we are about to take over are the ones in use. */
+
+static int check_station(struct linkstate* ls)
+{
+	int authorized = 1 << NL80211_STA_FLAG_AUTHORIZED;
+	struct nlgen* msg;
+	struct nlattr* at;
+	uint32_t* sf;
+
+	nl_new_cmd(&nl, nl80211, NL80211_CMD_GET_STATION, 0);
+	nl_put_u32(&nl, NL80211_ATTR_IFINDEX, ifc->ifindex);
+	nl_put(&nl, NL80211_ATTR_MAC, ls->bssid, 6);
+
+	if(!(msg = nl_send_recv_genl(&nl)))
+		return -1;
+	if(!(at = nl_get_nest(msg, NL80211_ATTR_STA_INFO)))
+		return -1;
+	if(!(sf = nl_sub_of_len(at, NL80211_STA_INFO_STA_FLAGS, 8)))
+		return -1;
+	if(!(sf[0] & sf[1] & authorized))
+		return -1;
+
+	return 0;
+}
+
+static struct scan* restore_scan_slot(struct linkstate* ls)
+{
+	struct scan* sc;
+
+	if(!(sc = grab_scan_slot(ls->bssid)))
+		return NULL;
+
+	if(!sc->freq) {
+		sc->type = ls->type;
+		sc->ess = grab_ess(ls->ssid, ls->slen);
+		sc->seen = uptime();
+	}
+
+	sc->freq = ls->freq;
+
+	return sc;
+}
+
+/* The rest of the code assumes the interface is idle on startup. */
+
+static void drop_link(void)
+{
+	nl_new_cmd(&nl, nl80211, NL80211_CMD_DISCONNECT, 0);
+	nl_put_u32(&nl, NL80211_ATTR_IFINDEX, ifc->ifindex);
+	nl_send_recv_ack(&nl);
+}
+
+/* Called on startup, in place of the initial scan. If anything does not
+   match, whatever link there is gets dropped, and the usual startup
+   sequence takes over.
+
+   Only synchronous requests here, see resume_link() for the rest. */
+
+int adopt_link(void)
+{
+	struct linkstate ls;
+	struct scan* sc;
+	int ret = -1;
+
+	if(load_link_state(&ls))
+		goto out;
+	if(check_interface(&ls))
+		goto drop;
+	if(check_station(&ls))
+		goto drop;
+	if(!(sc = restore_scan_slot(&ls)))
+		goto drop;
+	if(adopt_current_ap(sc))
+		goto drop;
+
+	adopt_eapol_state(&ls.ec);
+
+	ret = 0;
+	goto out;
+drop:
+	drop_link();
+out:
+	memzero(&ls, sizeof(ls));
+
+	return ret;
+}
+
+/* Synchronous requests drop any unrelated messages they run into,
+   so nothing may be sent asynchronously until adopt_link() and the
+   rest of the startup code is done with all the interfaces. */
+
+void resume_link(void)
+{
+	adopt_association();
+	request_neighbors();
+}
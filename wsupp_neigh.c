@@ -0,0 +1,362 @@
+#include <string.h>
+
+#include "common.h"
+
+#include "netlink.h"
+#include "netlink/genl.h"
+#include "netlink/genl/nl80211.h"
+
+#include "wsupp.h"
+
+/* 802.11k neighbor reports and 802.11v BSS transition management.
+
+   Once connected, we ask the AP for the list of its neighbors, that is,
+   other APs of the same ESS. Roam scans then only need to cover the
+   channels those are on, which are usually just one or two, instead of
+   all the channels where the ESS has been seen before.
+
+   The AP may also ask us to move to another AP (BTM request), typically
+   to balance the load or because it's about to go down. The request
+   comes with a list of candidates in the same format as neighbor reports.
+   If one of them is in the scan list, we accept and roam there right away.
+   Otherwise the request gets rejected, the candidate channels scanned,
+   and the decision made once the results are in.
+
+   Both kinds of requests come in as action frames, which we need to
+   register for in order to get them. The AP needs to know we support
+   either, which is done with a couple of extra IEs in ASSOCIATE.
+
+   Ref. IEEE 802.11-2020 9.4.2.36 Neighbor Report element
+                         9.4.2.44 RM Enabled Capabilities element
+                         9.6.6.6 Neighbor Report Request frame format
+                         9.6.13.9 BSS Transition Management Request
+                         9.6.13.10 BSS Transition Management Response */
+
+#define CAT_RADIO_MEASUREMENT 5
+#define CAT_WNM              10
+
+#define ACT_NEIGHBOR_REQUEST  4
+#define ACT_NEIGHBOR_REPORT   5
+#define ACT_BTM_REQUEST       7
+#define ACT_BTM_RESPONSE      8
+
+/* BTM request mode */
+#define BTM_CANDIDATES       (1<<0)
+#define BTM_TERMINATION      (1<<3)
+#define BTM_SESSION_URL      (1<<4)
+
+/* BTM response status */
+#define BTM_ACCEPT            0
+#define BTM_NO_CANDIDATES     7
+
+#define IE_NEIGHBOR_REPORT   52
+#define NR_CANDIDATE_PREF     3 /* subelement */
+
+struct mgmthdr {
+	byte fc[2];
+	byte duration[2];
+	byte da[6];
+	byte sa[6];
+	byte bssid[6];
+	byte seq[2];
+	byte payload[];
+};
+
+extern struct netlink nl;
+extern int nl80211;
+
+
+/* RM Enabled Capabilities with Neighbor Report bit set,
+   and Extended Capabilities with BSS Transition bit set. */
+
+static const char ies_caps[] = {
+	70, 5,  0x02, 0x00, 0x00, 0x00, 0x00,
+	127, 3, 0x00, 0x00, 0x08
+};
+
+static const struct match {
+	byte category;
+	byte action;
+} matches[] = {
+	{ CAT_RADIO_MEASUREMENT, ACT_NEIGHBOR_REPORT },
+	{ CAT_WNM,               ACT_BTM_REQUEST     }
+};
+
+/* Frame registrations are tied to the netlink socket, and stay
+   in place as long as the socket remains open. */
+
+void setup_frames(void)
+{
+	const struct match* mt;
+	uint16_t action = 0x00D0; /* management, action */
+
+	for(mt = matches; mt < matches + ARRAY_SIZE(matches); mt++) {
+		nl_new_cmd(&nl, nl80211, NL80211_CMD_REGISTER_FRAME, 0);
+		nl_put_u32(&nl, NL80211_ATTR_IFINDEX, ifc->ifindex);
+		nl_put(&nl, NL80211_ATTR_FRAME_TYPE, &action, sizeof(action));
+		nl_put(&nl, NL80211_ATTR_FRAME_MATCH, mt, sizeof(*mt));
+
+		if(nl_send_recv_ack(&nl) < 0)
+			return;
+	}
+
+	ifc->registered = 1;
+}
+
+int fill_assoc_ies(char* buf, int max)
+{
+	int len = ifc->ap.iesize;
+
+	if(len + (int)sizeof(ies_caps) > max)
+		return 0;
+
+	memcpy(buf, ifc->ap.ies, len);
+
+	if(!ifc->registered)
+		return len;
+
+	memcpy(buf + len, ies_caps, sizeof(ies_caps));
+
+	return len + sizeof(ies_caps);
+}
+
+static int send_action(byte* body, int len)
+{
+	byte buf[64];
+	struct mgmthdr* mh = (struct mgmthdr*) buf;
+
+	if(sizeof(*mh) + len > sizeof(buf))
+		return -1;
+
+	memzero(mh, sizeof(*mh));
+	mh->fc[0] = 0xD0;
+	memcpy(mh->da, ifc->ap.bssid, 6);
+	memcpy(mh->sa, ifc->smac, 6);
+	memcpy(mh->bssid, ifc->ap.bssid, 6);
+	memcpy(mh->payload, body, len);
+
+	return send_action_frame(buf, sizeof(*mh) + len);
+}
+
+void clear_neighbors(void)
+{
+	ifc->nneighs = 0;
+}
+
+void request_neighbors(void)
+{
+	byte req[3];
+
+	clear_neighbors();
+
+	if(!ifc->registered)
+		return;
+	if(!(ifc->ap.type & ST_RRM_NEIGHBORS))
+		return;
+
+	req[0] = CAT_RADIO_MEASUREMENT;
+	req[1] = ACT_NEIGHBOR_REQUEST;
+	req[2] = ++ifc->token;
+
+	send_action(req, sizeof(req));
+}
+
+/* Ref. IEEE 802.11-2020 Table E-4 Global operating classes */
+
+static int chan_freq(int opclass, int chan)
+{
+	if(opclass >= 131 && opclass <= 137)
+		return (opclass == 136 ? 5925 : 5950) + 5*chan;
+	if(chan == 14)
+		return 2484;
+	if(chan >= 1 && chan <= 13)
+		return 2407 + 5*chan;
+	if(chan >= 32 && chan <= 177)
+		return 5000 + 5*chan;
+
+	return 0;
+}
+
+static int candidate_pref(byte* p, byte* e)
+{
+	while(p + 2 <= e) {
+		int id = p[0];
+		int len = p[1];
+
+		if(p + 2 + len > e)
+			break;
+		if(id == NR_CANDIDATE_PREF && len >= 1)
+			return p[2];
+
+		p += 2 + len;
+	}
+
+	return 1; /* listed, but no preference given */
+}
+
+static void add_neighbor(byte* buf, int len)
+{
+	struct neigh* nb;
+	int freq;
+
+	if(len < 13)
+		return;
+	if(!memcmp(buf, ifc->ap.bssid, 6))
+		return;
+	if(!(freq = chan_freq(buf[10], buf[11])))
+		return;
+	if(ifc->nneighs >= NNEIGHS)
+		return;
+
+	nb = &ifc->neighs[ifc->nneighs++];
+	memcpy(nb->bssid, buf, 6);
+	nb->freq = freq;
+	nb->pref = candidate_pref(buf + 13, buf + len);
+}
+
+static void parse_neighbors(byte* p, byte* e)
+{
+	clear_neighbors();
+
+	while(p + 2 <= e) {
+		int id = p[0];
+		int len = p[1];
+
+		if(p + 2 + len > e)
+			break;
+		if(id == IE_NEIGHBOR_REPORT)
+			add_neighbor(p + 2, len);
+
+		p += 2 + len;
+	}
+}
+
+/* Preference 0 means the AP does not want us there.
+   Non-neighbors get -1. */
+
+int neighbor_pref(byte bssid[6])
+{
+	struct neigh* nb;
+
+	for(nb = ifc->neighs; nb < ifc->neighs + ifc->nneighs; nb++)
+		if(!memcmp(nb->bssid, bssid, 6))
+			return nb->pref;
+
+	return -1;
+}
+
+/* Channels for roam scans, see start_roam_scan(). The current one
+   is always included so that the signal of the current AP stays
+   comparable with the rest. */
+
+static int add_freq(int* freqs, int n, int freq)
+{
+	int i;
+
+	for(i = 0; i < n; i++)
+		if(freqs[i] == freq)
+			return n;
+	if(!chan_usable(freq))
+		return n;
+
+	freqs[n] = freq;
+
+	return n + 1;
+}
+
+int fill_neighbor_freqs(int* freqs, int max)
+{
+	struct neigh* nb;
+	int n = 0;
+
+	if(!ifc->nneighs || max < 1)
+		return 0;
+
+	n = add_freq(freqs, n, ifc->ap.freq);
+
+	for(nb = ifc->neighs; nb < ifc->neighs + ifc->nneighs; nb++)
+		if(n >= max)
+			break;
+		else if(nb->pref)
+			n = add_freq(freqs, n, nb->freq);
+
+	return n;
+}
+
+static void send_btm_response(byte tok, int status, byte* target)
+{
+	byte resp[11];
+	int len = 5;
+
+	resp[0] = CAT_WNM;
+	resp[1] = ACT_BTM_RESPONSE;
+	resp[2] = tok;
+	resp[3] = status;
+	resp[4] = 0; /* BSS termination delay */
+
+	if(target) {
+		memcpy(resp + 5, target, 6);
+		len += 6;
+	}
+
+	send_action(resp, len);
+}
+
+static void recv_neighbor_report(byte* buf, int len)
+{
+	if(len < 3 || buf[2] != ifc->token)
+		return;
+
+	parse_neighbors(buf + 3, buf + len);
+}
+
+static void recv_btm_request(byte* buf, int len)
+{
+	byte* e = buf + len;
+	byte* p = buf + 7;
+	struct scan* sc;
+	int tok, mode;
+
+	if(len < 7)
+		return;
+
+	tok = buf[2];
+	mode = buf[3];
+
+	if(mode & BTM_TERMINATION)
+		p += 12;
+	if((mode & BTM_SESSION_URL) && p < e)
+		p += 1 + *p;
+	if(p > e)
+		return;
+
+	if(mode & BTM_CANDIDATES)
+		parse_neighbors(p, e);
+
+	if((sc = find_transition_target())) {
+		send_btm_response(tok, BTM_ACCEPT, sc->bssid);
+		start_transition(sc);
+	} else {
+		send_btm_response(tok, BTM_NO_CANDIDATES, NULL);
+		start_transition_scan();
+	}
+}
+
+void handle_action_frame(byte* buf, int len)
+{
+	struct mgmthdr* mh = (struct mgmthdr*) buf;
+	byte* body = mh->payload;
+	int blen = len - sizeof(*mh);
+
+	if(ifc->authstate != AS_CONNECTED)
+		return;
+	if(blen < 2)
+		return;
+	if(memcmp(mh->sa, ifc->ap.bssid, 6))
+		return;
+
+	if(body[0] == CAT_RADIO_MEASUREMENT && body[1] == ACT_NEIGHBOR_REPORT)
+		recv_neighbor_report(body, blen);
+	else if(body[0] == CAT_WNM && body[1] == ACT_BTM_REQUEST)
+		recv_btm_request(body, blen);
+}
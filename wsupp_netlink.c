@@ -1,9 +1,14 @@
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <unistd.h>
 #include <string.h>
 #include <errno.h>
 #include <sys/socket.h>
+#include <sys/ioctl.h>
 #include <sys/file.h>
+#include <arpa/inet.h>
+#include <net/if.h>
 
 #include "common.h"
 
@@ -37,12 +42,43 @@
 	<- NL80211_CMD_TRIGGER_SCAN      start_scan
 	-> NL80211_CMD_TRIGGER_SCAN      cmd_trigger_scan
 	-> NL80211_CMD_NEW_SCAN_RESULTS  cmd_scan_results
+	<- NL80211_CMD_GET_SURVEY        trigger_survey_dump
+	-> NL80211_CMD_NEW_SURVEY_RESULTS* cmd_survey_results
+	...
 	<- NL80211_CMD_GET_SCAN          trigger_scan_dump
 	-> NL80211_CMD_NEW_SCAN_RESULTS* cmd_scan_results
 	-> NL80211_CMD_NEW_SCAN_RESULTS* cmd_scan_results
 	...
 	-> NL80211_CMD_NEW_SCAN_RESULTS* cmd_scan_results
 
+	# link monitoring, while connected
+	<- NL80211_CMD_SET_CQM           configure_cqm
+	-> NL80211_CMD_NOTIFY_CQM        cmd_notify_cqm
+
+	# channel switch, initiated by the AP
+	-> NL80211_CMD_CH_SWITCH_STARTED_NOTIFY  cmd_ch_switch
+	-> NL80211_CMD_CH_SWITCH_NOTIFY          cmd_ch_switch
+
+	# action frames, see wsupp_neigh.c
+	<- NL80211_CMD_FRAME             send_action_frame
+	-> NL80211_CMD_FRAME             cmd_frame
+
+	# group rekeys handled by the card, while connected
+	<- NL80211_CMD_SET_REKEY_OFFLOAD upload_rekey_data
+	-> NL80211_CMD_SET_REKEY_OFFLOAD cmd_rekey_offload
+
+   Scans started by somebody else (other tools, the kernel itself) also
+   end with a NEW_SCAN_RESULTS notification. If we are not scanning at
+   the time, the results get dumped and merged into the scan list just
+   like our own; see harvest_scan_results below.
+
+   With a scan interface given (a second radio, see setup_scan_iface),
+   scans made while connected run there instead, and the results get
+   dumped from there. The data radio then never leaves its channel.
+
+   With several interfaces managed, the results of any scan get merged
+   into the scan lists of all of them, see share_scan_results().
+
    Disconnect notifications may arrive spontaneously if initiated
    by the card (rfkill, or the AP going down), trigger_disconnect
    is only used to abort unsuccessful connection. */
@@ -50,6 +86,47 @@
 #define SR_SCANNING_ONE_FREQ (1<<0)
 #define SR_RECONNECT_CURRENT (1<<1)
 #define SR_CONNECT_SOMETHING (1<<2)
+#define SR_SCANNING_CHUNKED  (1<<3)
+#define SR_SCAN_ALL_CHUNKS   (1<<4)
+#define SR_REPORTED_SCANNING (1<<5)
+#define SR_HARVESTING        (1<<6)
+#define SR_CACHED_ONLY       (1<<7)
+#define SR_SCANNING_ROAM     (1<<8)
+
+/* Scans requested while a harvest dump is running, see start_scan() */
+
+#define QS_ONE_FREQ (1<<0)
+#define QS_FULL     (1<<1)
+#define QS_VOID     (1<<2)
+#define QS_ROAM     (1<<3)
+
+/* Rate limit for dumping the results of scans we did not request. */
+
+#define HARVEST_INTERVAL 5
+
+/* Kernel scan cache entries older than this are not worth trying
+   to connect to without scanning first. */
+
+#define CACHE_MAX_AGE 10000 /* ms */
+
+/* Entries not seen for this long get dropped from the scan list.
+   Before that, they only get marked stale, see wsupp_chans.c. */
+
+#define SCAN_MAX_AGE 10*60
+
+/* Per-phase deadlines for connection attempts. Working APs reply
+   within a few ms; a silent one gets abandoned quickly, and the next
+   candidate tried. EAPOL deadlines are in wsupp_eapol.c */
+
+#define AUTH_TIMEOUT   500 /* ms */
+#define ASSOC_TIMEOUT  500 /* ms */
+
+/* The kernel reports the signal crossing this level, in either direction,
+   which is how we learn that the link is getting weak without polling.
+   Should be somewhat below ROAM_THRESHOLD in wsupp_apsel.c */
+
+#define CQM_RSSI_THOLD -70 /* dBm */
+#define CQM_RSSI_HYST    4 /* dB */
 
 char txbuf[512];
 char rxbuf[8*1024];
@@ -58,14 +135,7 @@ extern const char errtag[];
 
 struct netlink nl;
 int netlink;
-static int nl80211;
-static int scanreq;
-static uint scanseq;
-
-int authstate;
-int scanstate;
-
-struct ap ap;
+int nl80211;
 
 #define MSG struct nlgen* msg __unused
 
@@ -86,85 +156,331 @@ void quit(const char* fmt, ...)
 	vfprintf(stderr, fmt, ap);
 	va_end(ap);
 
-	if(authstate == AS_IDLE)
-		goto out;
+	for(ifc = ifaces; ifc < ifaces + nifaces; ifc++) {
+		if(ifc->authstate == AS_IDLE)
+			continue;
+
+		nl_new_cmd(&nl, nl80211, NL80211_CMD_DISCONNECT, 0);
+		nl_put_u32(&nl, NL80211_ATTR_IFINDEX, ifc->ifindex);
+		nl_send_recv_ack(&nl);
+	}
 
-	nl_new_cmd(&nl, nl80211, NL80211_CMD_DISCONNECT, 0);
-	nl_put_u32(&nl, NL80211_ATTR_IFINDEX, ifindex);
-	nl_send_recv_ack(&nl);
-out:
 	unlink_control();
 	_exit(0xFF);
 }
 
-/* Socket-level errors on netlink socket should not happen. */
+/* Replies, errors and NLMSG_DONE only carry the seq of the request,
+   which is all there is to tell which interface they belong to.
+   The kernel answers requests in order, and quickly, so a short ring
+   of the recent ones is enough to look them up. */
+
+#define NSENT 64
+
+static struct sent {
+	uint seq;
+	struct iface* ifc;
+} sent[NSENT];
+
+static void own_request(void)
+{
+	struct sent* sn = &sent[nl.seq % NSENT];
+
+	sn->seq = nl.seq;
+	sn->ifc = ifc;
+}
+
+static int send_request(void)
+{
+	int ret;
+
+	if((ret = nl_send(&nl)) >= 0)
+		own_request();
+
+	return ret;
+}
+
+static int send_dump(void)
+{
+	int ret;
+
+	if((ret = nl_send_dump(&nl)) >= 0)
+		own_request();
+
+	return ret;
+}
+
+static struct iface* request_owner(uint seq)
+{
+	struct sent* sn = &sent[seq % NSENT];
+
+	return (sn->seq == seq) ? sn->ifc : NULL;
+}
+
+/* Socket-level errors on netlink socket should not happen. If one does,
+   only the interface the request was for gets taken down. */
 
 static void send_check(void)
 {
-	if(nl_send(&nl) >= 0)
+	if(send_request() >= 0)
 		return;
 
-	quit("nl-send: %m\n");
+	drop_iface("nl-send: %m\n");
 }
 
 static void send_set_authstate(int as)
 {
 	send_check();
 
-	authstate = as;
+	ifc->authstate = as;
 }
 
 static void reset_scan_state(void)
 {
-	scanstate = SS_IDLE;
-	scanseq = 0;
-	scanreq = 0;
+	ifc->scanstate = SS_IDLE;
+	ifc->scanseq = 0;
+	ifc->scanreq = 0;
+	ifc->scanchunk = 0;
+	ifc->scanqueue = 0;
+}
+
+/* Failures that only concern one of the managed interfaces take that
+   one down, leaving the rest running. Unlike quit(), the DISCONNECT
+   goes out without waiting for the ACK, which would mean dropping
+   the notifications meant for other interfaces. Once in OP_EXIT, the
+   interface gets no more events, and the whole process exits when
+   none remain. */
+
+void drop_iface(const char* fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	fprintf(stderr, "%s: %s: ", errtag, ifc->ifname);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+
+	if(ifc->opermode == OP_EXIT)
+		return;
+
+	if(ifc->authstate != AS_IDLE && ifc->authstate != AS_NETDOWN) {
+		nl_new_cmd(&nl, nl80211, NL80211_CMD_DISCONNECT, 0);
+		nl_put_u32(&nl, NL80211_ATTR_IFINDEX, ifc->ifindex);
+		send_request();
+		kill_dhcp();
+		report_net_down();
+	}
+
+	if(ifc->rawsock >= 0) {
+		close(ifc->rawsock);
+		ifc->rawsock = -1;
+		pollset = 0;
+	}
+
+	clr_timer();
+	clr_deadline();
+	reset_scan_state();
+
+	ifc->authstate = AS_IDLE;
+	ifc->opermode = OP_EXIT;
+}
+
+static int put_scan_chunk(void)
+{
+	int freqs[NCHANS];
+	struct nlattr* at;
+	int i, n;
+
+	while(!(n = fill_scan_chunk(ifc->scanchunk, freqs, NCHANS)))
+		ifc->scanchunk++;
+	if(n < 0)
+		return n;
+
+	ifc->scanchunk++;
+
+	at = nl_put_nest(&nl, NL80211_ATTR_SCAN_FREQUENCIES);
+	for(i = 0; i < n; i++)
+		nl_put_u32(&nl, i, freqs[i]);
+	nl_end_nest(&nl, at);
+
+	return 0;
+}
+
+/* Roam scans go for the channels of the neighbors the AP has reported.
+   Failing that, the channels where APs of the current ESS have been
+   seen before, that is, the first chunk of a chunked scan, and nothing
+   past it. If that one is empty, there is nothing to roam to. */
+
+static int put_roam_freqs(void)
+{
+	int freqs[NCHANS];
+	struct nlattr* at;
+	int i, n;
+
+	if(!(n = fill_neighbor_freqs(freqs, NCHANS)))
+		n = fill_scan_chunk(0, freqs, NCHANS);
+	if(n <= 0)
+		return -ENOENT;
+
+	at = nl_put_nest(&nl, NL80211_ATTR_SCAN_FREQUENCIES);
+	for(i = 0; i < n; i++)
+		nl_put_u32(&nl, i, freqs[i]);
+	nl_end_nest(&nl, at);
+
+	return 0;
+}
+
+/* The data radio has to go off-channel to scan, which costs traffic
+   while connected. A helper radio, if there is one, has nothing better
+   to do. Scans made to connect still run on the data radio, because
+   the kernel only authenticates with APs from the radio's own cache.
+   Roaming to an AP found by the helper may therefore take a one-channel
+   rescan on ENOENT, see handle_auth_error(). */
+
+static int scan_iface(void)
+{
+	if(ifc->scanifi && ifc->authstate == AS_CONNECTED)
+		return ifc->scanifi;
+
+	return ifc->ifindex;
+}
+
+static int trigger_scan(int freq)
+{
+	struct nlattr* at;
+	int ret;
+
+	ifc->scanon = scan_iface();
+
+	nl_new_cmd(&nl, nl80211, NL80211_CMD_TRIGGER_SCAN, 0);
+	nl_put_u32(&nl, NL80211_ATTR_IFINDEX, ifc->scanon);
+
+	if(freq > 0) {
+		at = nl_put_nest(&nl, NL80211_ATTR_SCAN_FREQUENCIES);
+		nl_put_u32(&nl, 0, freq); /* 0 is index here */
+		nl_end_nest(&nl, at);
+	} else if(ifc->scanreq & SR_SCANNING_ROAM) {
+		if((ret = put_roam_freqs()) < 0)
+			return ret;
+	} else if(ifc->scanreq & SR_SCANNING_CHUNKED) {
+		if((ret = put_scan_chunk()) < 0)
+			return ret;
+	}
+
+	if(freq <= 0 && scan_colocated_6ghz())
+		nl_put_u32(&nl, NL80211_ATTR_SCAN_FLAGS,
+				NL80211_SCAN_FLAG_COLOCATED_6GHZ);
+
+	if((ret = send_request()) < 0)
+		return ret;
+
+	ifc->scanstate = SS_SCANNING;
+	ifc->scanseq = nl.seq;
+
+	return 0;
 }
 
 /* The weird logic below handles the cases when a re-scan or a routine
-   scheduled scan coincides with a user-requested full range scan. */
+   scheduled scan coincides with a user-requested full range scan.
+
+   Full scans meant to find something to connect to get chunked,
+   see comments in wsupp_chans.c. Void scans are only done to get
+   the list of APs, so those always cover the whole range at once.
+   If one gets requested during a chunked scan, all chunks must be
+   scanned even if a good AP turns up early.
+
+   A harvest dump cannot be abandoned halfway. Its NLMSG_DONE would
+   be taken for the end of our own dump, and the kernel does not run
+   two dumps at once on the same socket anyway. Requests made while
+   one is running get queued, and started once it is done. */
+
+static int queue_scan(int freq)
+{
+	if(freq > 0)
+		ifc->scanqueue |= QS_ONE_FREQ;
+	else if(freq < 0)
+		ifc->scanqueue |= QS_FULL;
+	else
+		ifc->scanqueue |= QS_VOID;
+
+	return 0;
+}
+
+static void start_queued_scans(int queued)
+{
+	if(ifc->scanstate != SS_IDLE)
+		return;
+	if(ifc->authstate != AS_IDLE && ifc->authstate != AS_CONNECTED)
+		return;
+
+	if(queued & QS_ONE_FREQ)
+		start_scan(ifc->ap.freq);
+	if(queued & QS_FULL)
+		start_scan(-1);
+	if(queued & QS_VOID)
+		start_scan(0);
+	if(queued & QS_ROAM)
+		start_roam_scan();
+}
 
 int start_scan(int freq)
 {
-	struct nlattr* at;
 	int ret;
 
-	if(scanstate == SS_IDLE) {
+	if(ifc->scanreq & SR_HARVESTING)
+		return queue_scan(freq);
+
+	if(ifc->scanstate == SS_IDLE) {
 		/* no ongoing scan, great */
 		if(freq > 0)
-			scanreq |= SR_RECONNECT_CURRENT;
+			ifc->scanreq |= SR_RECONNECT_CURRENT;
 		if(freq < 0)
-			scanreq |= SR_CONNECT_SOMETHING;
-	} else if(scanreq & SR_SCANNING_ONE_FREQ) {
+			ifc->scanreq |= SR_CONNECT_SOMETHING;
+	} else if(ifc->scanreq & SR_SCANNING_ONE_FREQ) {
 		/* ongoing single-freq scan, bad */
 		return -EBUSY;
 	} else { /* ongoing whole-range scan */
 		if(freq > 0)
-			scanreq |= SR_RECONNECT_CURRENT;
+			ifc->scanreq |= SR_RECONNECT_CURRENT;
 		if(freq < 0)
-			scanreq |= SR_CONNECT_SOMETHING;
+			ifc->scanreq |= SR_CONNECT_SOMETHING;
+		if(!freq)
+			ifc->scanreq |= SR_SCAN_ALL_CHUNKS;
 		return 0;
 	}
 
-	nl_new_cmd(&nl, nl80211, NL80211_CMD_TRIGGER_SCAN, 0);
-	nl_put_u32(&nl, NL80211_ATTR_IFINDEX, ifindex);
-
 	if(freq > 0) {
-		scanreq |= SR_SCANNING_ONE_FREQ | SR_RECONNECT_CURRENT;
-		at = nl_put_nest(&nl, NL80211_ATTR_SCAN_FREQUENCIES);
-		nl_put_u32(&nl, 0, freq); /* 0 is index here */
-		nl_end_nest(&nl, at);
+		ifc->scanreq |= SR_SCANNING_ONE_FREQ | SR_RECONNECT_CURRENT;
+	} else if(freq < 0 && ifc->nchans) {
+		ifc->scanreq |= SR_SCANNING_CHUNKED;
+		reset_scan_chunks();
 	}
 
-	if((ret = nl_send(&nl)) < 0) {
-		scanreq = 0;
-		return ret;
+	if((ret = trigger_scan(freq)) < 0)
+		ifc->scanreq = 0;
+
+	return ret;
+}
+
+int start_roam_scan(void)
+{
+	int ret;
+
+	if(ifc->scanreq & SR_HARVESTING) {
+		ifc->scanqueue |= QS_ROAM;
+		return 0;
 	}
+	if(ifc->scanstate != SS_IDLE)
+		return -EBUSY;
+	if(!ifc->nchans)
+		return start_void_scan();
 
-	scanstate = SS_SCANNING;
-	scanseq = nl.seq;
+	ifc->scanreq = SR_SCANNING_ROAM;
+	reset_scan_chunks();
 
-	return 0;
+	if((ret = trigger_scan(-1)) < 0)
+		ifc->scanreq = 0;
+
+	return ret;
 }
 
 int start_void_scan(void)
@@ -177,26 +493,23 @@ int start_full_scan(void)
 	return start_scan(-1);
 }
 
-static void mark_stale_scan_slots(struct nlgen* msg)
+/* NL80211_CMD_NEW_SCAN_RESULTS comes with the list of frequencies
+   that have been scanned. Only used when the results are about to be
+   dumped, otherwise the APs seen on those channels would look stale. */
+
+static void mark_scanned_freqs(struct nlgen* msg)
 {
 	struct nlattr* at;
 	struct nlattr* sb;
-	int32_t* fq;
-	struct scan* sc;
+	uint32_t* fq;
+	int now = uptime();
 
 	if(!(at = nl_get_nest(msg, NL80211_ATTR_SCAN_FREQUENCIES)))
 		return;
 
-	for(sc = scans; sc < scans + nscans; sc++) {
-		if(!sc->freq)
-			continue;
-		for(sb = nl_sub_0(at); sb; sb = nl_sub_n(at, sb))
-			if(!(fq = (int*)nl_u32(sb)))
-				continue;
-			else if(*fq == sc->freq)
-				break;
-		if(sb) sc->flags |= SF_STALE;
-	}
+	for(sb = nl_sub_0(at); sb; sb = nl_sub_n(at, sb))
+		if((fq = nl_u32(sb)))
+			mark_scanned_freq(*fq, now);
 }
 
 static void trigger_scan_dump(void)
@@ -204,23 +517,91 @@ static void trigger_scan_dump(void)
 	int ret;
 
 	nl_new_cmd(&nl, nl80211, NL80211_CMD_GET_SCAN, 0);
-	nl_put_u32(&nl, NL80211_ATTR_IFINDEX, ifindex);
+	nl_put_u32(&nl, NL80211_ATTR_IFINDEX, ifc->scanon);
 	
-	if((ret = nl_send_dump(&nl)) < 0) {
+	if((ret = send_dump()) < 0) {
 		warn("nl-send scan dump");
 		reset_scan_state();
 	} else {
-		scanstate = SS_SCANDUMP;
-		scanseq = nl.seq;
+		ifc->scanstate = SS_SCANDUMP;
+		ifc->scanseq = nl.seq;
 	}
 }
 
+/* Channel survey gets dumped before the scan results, so that the busy
+   time is known by the time the results are evaluated. Cards that do
+   not support surveys only get asked once. */
+
+static void trigger_survey_dump(void)
+{
+	if(ifc->nosurvey)
+		return trigger_scan_dump();
+
+	nl_new_cmd(&nl, nl80211, NL80211_CMD_GET_SURVEY, 0);
+	nl_put_u32(&nl, NL80211_ATTR_IFINDEX, ifc->scanon);
+
+	if(send_dump() < 0) {
+		ifc->nosurvey = 1;
+		return trigger_scan_dump();
+	}
+
+	ifc->scanstate = SS_SURVEYDUMP;
+	ifc->scanseq = nl.seq;
+}
+
+static void cmd_survey_results(MSG)
+{
+	struct nlattr* si;
+	uint32_t* freq;
+	uint64_t *time, *busy;
+
+	if(ifc->scanstate != SS_SURVEYDUMP)
+		return;
+	if(!(si = nl_get_nest(msg, NL80211_ATTR_SURVEY_INFO)))
+		return;
+	if(!(freq = nl_sub_u32(si, NL80211_SURVEY_INFO_FREQUENCY)))
+		return;
+	if(!(time = nl_sub_u64(si, NL80211_SURVEY_INFO_TIME)) || !*time)
+		return;
+	if(!(busy = nl_sub_u64(si, NL80211_SURVEY_INFO_TIME_BUSY)))
+		return;
+	if(*busy > *time)
+		return;
+
+	set_channel_busy(*freq, (*busy * 255) / *time);
+}
+
 static int get_i32_or_zero(struct nlattr* bss, int key)
 {
 	int32_t* val = nl_sub_i32(bss, key);
 	return val ? *val : 0;
 }
 
+/* LAST_SEEN_BOOTTIME is on the same clock as uptime(), but only
+   reported by newer kernels. */
+
+static int last_seen(struct nlattr* bss)
+{
+	uint64_t* ns;
+
+	if((ns = nl_sub_u64(bss, NL80211_BSS_LAST_SEEN_BOOTTIME)))
+		return *ns / 1000000000;
+
+	return uptime() - get_i32_or_zero(bss, NL80211_BSS_SEEN_MS_AGO)/1000;
+}
+
+static int too_old_for_cache(struct nlattr* bss)
+{
+	uint32_t* age;
+
+	if(!(ifc->scanreq & SR_CACHED_ONLY))
+		return 0;
+	if(!(age = nl_sub_u32(bss, NL80211_BSS_SEEN_MS_AGO)))
+		return 1;
+
+	return (*age > CACHE_MAX_AGE);
+}
+
 static void parse_scan_result(struct nlgen* msg)
 {
 	struct scan* sc;
@@ -232,33 +613,87 @@ static void parse_scan_result(struct nlgen* msg)
 		return;
 	if(!(bssid = nl_sub_of_len(bss, NL80211_BSS_BSSID, 6)))
 		return;
+	if(too_old_for_cache(bss))
+		return;
 	if(!(sc = grab_scan_slot(bssid)))
 		return; /* out of scan slots */
 
+	unrank_scan(sc); /* the keys change below, see compare() */
+
 	memcpy(sc->bssid, bssid, 6);
 	sc->freq = get_i32_or_zero(bss, NL80211_BSS_FREQUENCY);
 	sc->signal = get_i32_or_zero(bss, NL80211_BSS_SIGNAL_MBM);
-	sc->type = 0;
-	sc->flags &= ~SF_STALE;
+	sc->seen = last_seen(bss);
+	sc->flags |= SF_DIRTY;
 
 	if((ies = nl_sub(bss, NL80211_BSS_INFORMATION_ELEMENTS)))
 		parse_station_ies(sc, ies->payload, nl_attr_len(ies));
+	else
+		sc->type = sc->ielen = sc->iehash = 0;
+
+	share_scan(sc);
 }
 
-/* NL80211_CMD_TRIGGER_SCAN arrives with a list of frequencies being
-   scanned. We use it to mark and later remove stale scan entries.
-   The list may not be a complete one, esp. with single-freq scans. */
+static int msg_ifi(struct nlgen* msg)
+{
+	int32_t* ifi;
+
+	if(!(ifi = nl_get_i32(msg, NL80211_ATTR_IFINDEX)))
+		return 0;
+
+	return *ifi;
+}
 
 static void cmd_trigger_scan(MSG)
 {
-	if(scanstate != SS_SCANNING)
+	if(ifc->scanstate != SS_SCANNING)
+		return;
+	if(msg_ifi(msg) != ifc->scanon)
 		return;
+	if(ifc->scanreq & SR_REPORTED_SCANNING)
+		return; /* next chunk of the same scan */
 
-	mark_stale_scan_slots(msg);
+	ifc->scanreq |= SR_REPORTED_SCANNING;
 
 	report_scanning();
 }
 
+/* Somebody else's scan is just as good as ours, and dumping the results
+   costs much less than running a scan. Dumps get rate-limited in case
+   some other process keeps scanning all the time.
+
+   Our own scan requests made while the harvest dump is running wait
+   for it to finish, see start_scan(). */
+
+static void harvest_scan_results(struct nlgen* msg)
+{
+	if(uptime() - ifc->lastscan < HARVEST_INTERVAL)
+		return;
+
+	ifc->scanreq = SR_HARVESTING;
+	ifc->scanon = msg_ifi(msg);
+	mark_scanned_freqs(msg);
+
+	trigger_scan_dump();
+}
+
+/* The kernel may already have fresh scan results when wsupp starts,
+   from whoever was scanning before. Dumping them takes no airtime,
+   and may let us connect without waiting for a full scan. */
+
+int dump_cached_scan(void)
+{
+	if(ifc->scanstate != SS_IDLE)
+		return -EBUSY;
+
+	ifc->scanreq = SR_CACHED_ONLY;
+	ifc->scanon = ifc->ifindex;
+
+	trigger_scan_dump();
+
+	return (ifc->scanstate == SS_SCANDUMP) ? 0 : -EIO;
+}
+
 /* Non-MULTI scan results command means the card is done scanning,
    and it comes empty. We must then trigger scan dump, which results
    in a bunch of messages with the same command code *but* also with
@@ -266,15 +701,23 @@ static void cmd_trigger_scan(MSG)
 
 static void cmd_scan_results(MSG)
 {
-	if(msg->nlm.flags & NLM_F_MULTI)
+	if(msg->nlm.flags & NLM_F_MULTI) {
 		parse_scan_result(msg);
-	else if(scanstate == SS_SCANNING)
-		trigger_scan_dump();
+	} else if(ifc->scanstate == SS_SCANNING) {
+		if(msg_ifi(msg) != ifc->scanon)
+			return;
+		mark_scanned_freqs(msg);
+		trigger_survey_dump();
+	} else if(ifc->scanstate == SS_IDLE) {
+		harvest_scan_results(msg);
+	}
 }
 
 static void cmd_scan_aborted(MSG)
 {
-	if(scanstate != SS_SCANNING)
+	if(ifc->scanstate != SS_SCANNING)
+		return;
+	if(msg_ifi(msg) != ifc->scanon)
 		return;
 
 	warn("scan aborted\n");
@@ -287,47 +730,87 @@ static void trigger_authentication(void)
 {
 	int authtype = 0;
 
+	prewarm_eapol();
+
 	nl_new_cmd(&nl, nl80211, NL80211_CMD_AUTHENTICATE, 0);
-	nl_put_u32(&nl, NL80211_ATTR_IFINDEX, ifindex);
-	nl_put(&nl, NL80211_ATTR_MAC, ap.bssid, sizeof(ap.bssid));
-	nl_put_u32(&nl, NL80211_ATTR_WIPHY_FREQ, ap.freq);
-	nl_put(&nl, NL80211_ATTR_SSID, ap.ssid, ap.slen);
+	nl_put_u32(&nl, NL80211_ATTR_IFINDEX, ifc->ifindex);
+	nl_put(&nl, NL80211_ATTR_MAC, ifc->ap.bssid, sizeof(ifc->ap.bssid));
+	nl_put_u32(&nl, NL80211_ATTR_WIPHY_FREQ, ifc->ap.freq);
+	nl_put(&nl, NL80211_ATTR_SSID, ifc->ap.ssid, ifc->ap.slen);
 	nl_put_u32(&nl, NL80211_ATTR_AUTH_TYPE, authtype);
 
 	send_set_authstate(AS_AUTHENTICATING);
+	set_deadline(AUTH_TIMEOUT);
 }
 
 int start_connection(void)
 {
-	if(authstate != AS_IDLE)
+	if(ifc->authstate != AS_IDLE)
 		return -EBUSY;
-	if(scanstate != SS_IDLE)
+	if(ifc->scanstate != SS_IDLE)
 		return -EBUSY;
 
-	reopen_rawsock();
+	if(reopen_rawsock() < 0)
+		return -ENETDOWN;
+
+	hist_attempt();
 
 	trigger_authentication();
 	
 	return 0;
 }
 
+/* Roaming means moving to another AP of the same ESS while still
+   connected to the current one. The caller has already switched
+   struct ap to the new AP. The kernel drops the old link once we
+   authenticate with the new AP, and the DISCONNECT it reports for
+   the old link gets ignored, see cmd_disconnect. ASSOCIATE then goes
+   out with PREV_BSSID, making it a reassociation. */
+
+int start_roaming(byte prev[6])
+{
+	if(ifc->authstate != AS_CONNECTED)
+		return -EBUSY;
+	if(ifc->scanstate != SS_IDLE)
+		return -EBUSY;
+
+	memcpy(ifc->prevbssid, prev, 6);
+
+	reset_eapol_state();
+
+	if(reopen_rawsock() < 0)
+		return -ENETDOWN;
+
+	hist_attempt();
+
+	trigger_authentication();
+
+	return 0;
+}
+
 static void trigger_associaction(void)
 {
+	char ies[128];
+
 	nl_new_cmd(&nl, nl80211, NL80211_CMD_ASSOCIATE, 0);
-	nl_put_u32(&nl, NL80211_ATTR_IFINDEX, ifindex);
-	nl_put(&nl, NL80211_ATTR_MAC, ap.bssid, sizeof(ap.bssid));
-	nl_put_u32(&nl, NL80211_ATTR_WIPHY_FREQ, ap.freq);
-	nl_put(&nl, NL80211_ATTR_SSID, ap.ssid, ap.slen);
+	nl_put_u32(&nl, NL80211_ATTR_IFINDEX, ifc->ifindex);
+	nl_put(&nl, NL80211_ATTR_MAC, ifc->ap.bssid, sizeof(ifc->ap.bssid));
+	nl_put_u32(&nl, NL80211_ATTR_WIPHY_FREQ, ifc->ap.freq);
+	nl_put(&nl, NL80211_ATTR_SSID, ifc->ap.ssid, ifc->ap.slen);
+
+	nl_put(&nl, NL80211_ATTR_IE, ies, fill_assoc_ies(ies, sizeof(ies)));
 
-	nl_put(&nl, NL80211_ATTR_IE, ap.ies, ap.iesize);
+	if(is_roaming())
+		nl_put(&nl, NL80211_ATTR_PREV_BSSID, ifc->prevbssid, 6);
 
 	send_set_authstate(AS_ASSOCIATING);
+	set_deadline(ASSOC_TIMEOUT);
 }
 
 static void trigger_disconnect(void)
 {
 	nl_new_cmd(&nl, nl80211, NL80211_CMD_DISCONNECT, 0);
-	nl_put_u32(&nl, NL80211_ATTR_IFINDEX, ifindex);
+	nl_put_u32(&nl, NL80211_ATTR_IFINDEX, ifc->ifindex);
 
 	send_set_authstate(AS_DISCONNECTING);
 }
@@ -338,8 +821,8 @@ static void trigger_disconnect(void)
 
 static void snap_to_disabled(char* why)
 {
-	opermode = OP_NEUTRAL;
-	authstate = AS_EXTERNAL;
+	ifc->opermode = OP_NEUTRAL;
+	ifc->authstate = AS_EXTERNAL;
 
 	warn("EAPOL %s\n", why);
 
@@ -353,12 +836,27 @@ static void snap_to_disabled(char* why)
    over netlink, pretty everything else happens either on its own or through
    the rawsock. */
 
+/* The AP may not be where we think it is, especially when connecting
+   without scanning first. Scanning its frequency tells whether it is
+   still around, see reconnect_to_current_ap(). */
+
+static void rescan_current_freq(void)
+{
+	clr_deadline();
+	ifc->authstate = AS_IDLE;
+	start_scan(ifc->ap.freq);
+}
+
 static void cmd_authenticate(MSG)
 {
-	if(authstate == AS_EXTERNAL)
+	if(ifc->authstate == AS_EXTERNAL)
 		return;
-	if(authstate != AS_AUTHENTICATING)
+	if(ifc->authstate != AS_AUTHENTICATING)
 		return snap_to_disabled("out-of-order AUTH");
+	if(nl_get(msg, NL80211_ATTR_TIMED_OUT)) {
+		note_failure(ifc->ap.bssid, ifc->authstate);
+		return rescan_current_freq();
+	}
 
 	prime_eapol_state();
 
@@ -367,24 +865,174 @@ static void cmd_authenticate(MSG)
 
 static void cmd_associate(MSG)
 {
-	if(authstate == AS_EXTERNAL)
+	if(ifc->authstate == AS_EXTERNAL)
 		return;
-	if(authstate != AS_ASSOCIATING)
+	if(ifc->authstate != AS_ASSOCIATING)
 		return snap_to_disabled("out-of-order ASSOC");
 
 	allow_eapol_sends();
 
-	authstate = AS_CONNECTING;
+	ifc->authstate = AS_CONNECTING;
+}
+
+/* Connection quality monitoring. Packet loss and beacon loss events
+   need no setup, only the RSSI threshold does. Not all drivers support
+   it, so errors for SET_CQM are ignored, see genl_error. */
+
+static void configure_cqm(void)
+{
+	struct nlattr* at;
+
+	nl_new_cmd(&nl, nl80211, NL80211_CMD_SET_CQM, 0);
+	nl_put_u32(&nl, NL80211_ATTR_IFINDEX, ifc->ifindex);
+
+	at = nl_put_nest(&nl, NL80211_ATTR_CQM);
+	nl_put_u32(&nl, NL80211_ATTR_CQM_RSSI_THOLD, CQM_RSSI_THOLD);
+	nl_put_u32(&nl, NL80211_ATTR_CQM_RSSI_HYST, CQM_RSSI_HYST);
+	nl_end_nest(&nl, at);
+
+	if(send_request() < 0)
+		return;
+
+	ifc->cqmseq = nl.seq;
+}
+
+static void cmd_ch_switch(MSG)
+{
+	uint32_t* freq;
+
+	if(ifc->authstate == AS_IDLE || ifc->authstate == AS_EXTERNAL)
+		return;
+	if(!(freq = nl_get_u32(msg, NL80211_ATTR_WIPHY_FREQ)))
+		return;
+
+	handle_channel_switch(*freq);
+}
+
+/* Action frames are not essential for anything, so errors
+   for those are ignored just like for SET_CQM. */
+
+int send_action_frame(void* buf, int len)
+{
+	int ret;
+
+	nl_new_cmd(&nl, nl80211, NL80211_CMD_FRAME, 0);
+	nl_put_u32(&nl, NL80211_ATTR_IFINDEX, ifc->ifindex);
+	nl_put(&nl, NL80211_ATTR_FRAME, buf, len);
+
+	if((ret = send_request()) < 0)
+		return ret;
+
+	ifc->frameseq = nl.seq;
+
+	return 0;
+}
+
+static void cmd_frame(MSG)
+{
+	struct nlattr* at;
+
+	if(!(at = nl_get(msg, NL80211_ATTR_FRAME)))
+		return;
+
+	handle_action_frame((byte*)at->payload, nl_attr_len(at));
+}
+
+/* With GTK rekey offload, the card answers group rekeys on its own,
+   so the host may stay suspended while connected. It needs KEK, KCK
+   and the replay counter for that, and those change with every
+   handshake we do ourselves. Drivers that cannot do it reply with
+   an error, and then we stop trying, see genl_error. */
+
+void upload_rekey_data(void)
+{
+	struct nlattr* at;
+
+	if(ifc->norekey)
+		return;
+
+	nl_new_cmd(&nl, nl80211, NL80211_CMD_SET_REKEY_OFFLOAD, 0);
+	nl_put_u32(&nl, NL80211_ATTR_IFINDEX, ifc->ifindex);
+
+	at = nl_put_nest(&nl, NL80211_ATTR_REKEY_DATA);
+	nl_put(&nl, NL80211_REKEY_DATA_KEK, ifc->KEK, 16);
+	nl_put(&nl, NL80211_REKEY_DATA_KCK, ifc->KCK, 16);
+	nl_put(&nl, NL80211_REKEY_DATA_REPLAY_CTR, ifc->replay, 8);
+	nl_end_nest(&nl, at);
+
+	if(send_request() < 0)
+		return;
+
+	ifc->rekeyseq = nl.seq;
+}
+
+/* The card reports each rekey it has done, possibly long after
+   the fact if the host was asleep. The new GTK stays in the card,
+   but the replay counter must be picked up or the next rekey done
+   by the host would get rejected as a replay. */
+
+static void cmd_rekey_offload(MSG)
+{
+	struct nlattr* at;
+	byte* ctr;
+
+	if(ifc->authstate != AS_CONNECTED)
+		return;
+	if(!(at = nl_get_nest(msg, NL80211_ATTR_REKEY_DATA)))
+		return;
+	if(!(ctr = nl_sub_of_len(at, NL80211_REKEY_DATA_REPLAY_CTR, 8)))
+		return;
+
+	sync_rekey_state(ctr);
 }
 
 static void cmd_connect(MSG)
 {
-	if(authstate == AS_EXTERNAL)
+	if(ifc->authstate == AS_EXTERNAL)
 		return;
-	if(authstate != AS_CONNECTING)
+	if(ifc->authstate != AS_CONNECTING)
 		snap_to_disabled("out-of-order CONNECT");
 
-	authstate = AS_CONNECTED;
+	ifc->authstate = AS_CONNECTED;
+
+	configure_cqm();
+}
+
+/* Hitless restart, see wsupp_link.c. The link is already up,
+   we only need to catch up with it. */
+
+void adopt_association(void)
+{
+	ifc->authstate = AS_CONNECTED;
+
+	configure_cqm();
+}
+
+/* Low signal and lost packets mean it's time to look for another AP
+   of the same ESS. Lost beacons likely mean the AP is gone, and the
+   kernel will take a while to notice, so we move on right away. */
+
+static void cmd_notify_cqm(MSG)
+{
+	struct nlattr* at;
+	uint32_t* ev;
+
+	if(ifc->authstate != AS_CONNECTED)
+		return;
+	if(!(at = nl_get_nest(msg, NL80211_ATTR_CQM)))
+		return;
+
+	if(nl_sub(at, NL80211_ATTR_CQM_BEACON_LOSS_EVENT))
+		return handle_beacon_loss();
+	if(nl_sub(at, NL80211_ATTR_CQM_PKT_LOSS_EVENT))
+		return handle_weak_signal();
+	if(!(ev = nl_sub_u32(at, NL80211_ATTR_CQM_RSSI_THRESHOLD_EVENT)))
+		return;
+
+	if(*ev == NL80211_CQM_RSSI_THRESHOLD_EVENT_LOW)
+		handle_weak_signal();
+	else if(*ev == NL80211_CQM_RSSI_BEACON_LOSS_EVENT)
+		handle_beacon_loss();
 }
 
 /* start_disconnect is for user requests,
@@ -392,7 +1040,7 @@ static void cmd_connect(MSG)
 
 int start_disconnect(void)
 {
-	switch(authstate) {
+	switch(ifc->authstate) {
 		case AS_IDLE:
 		case AS_NETDOWN:
 			return -EALREADY;
@@ -405,22 +1053,59 @@ int start_disconnect(void)
 	return 0;
 }
 
+/* EAPOL exchange happens after the kernel reports the link connected,
+   but failing it is still a failure to connect. This includes the AP
+   dropping us mid-handshake, which is how a wrong PSK usually ends. */
+
+static int failed_phase(void)
+{
+	if(ifc->authstate == AS_CONNECTED && ifc->eapolstate != ES_NEGOTIATED)
+		return AS_CONNECTING;
+
+	return ifc->authstate;
+}
+
 void abort_connection(void)
 {
+	clr_deadline();
+	note_failure(ifc->ap.bssid, failed_phase());
+
 	if(start_disconnect() >= 0)
 		return;
 
 	reassess_wifi_situation();
 }
 
+/* Silent APs. The attempt gets aborted, and once the disconnect
+   goes through, handle_disconnect() moves on to the next candidate. */
+
+void handle_deadline(void)
+{
+	if(ifc->authstate < AS_AUTHENTICATING || ifc->authstate > AS_CONNECTED)
+		return;
+	if(ifc->authstate == AS_CONNECTED && ifc->eapolstate == ES_NEGOTIATED)
+		return;
+
+	abort_connection();
+}
+
 static void cmd_disconnect(MSG)
 {
-	if(authstate == AS_IDLE)
+	uint16_t* reason = nl_get_u16(msg, NL80211_ATTR_REASON_CODE);
+	int byap = !!nl_get(msg, NL80211_ATTR_DISCONNECTED_BY_AP);
+
+	if(ifc->authstate == AS_IDLE)
 		return;
+	if(is_roaming() && ifc->authstate == AS_AUTHENTICATING) {
+		hist_disconnected(ifc->prevbssid, reason ? *reason : 0, byap);
+		return; /* the old link going down */
+	}
 
+	note_failure(ifc->ap.bssid, failed_phase());
 	reset_eapol_state();
+	hist_disconnected(ifc->ap.bssid, reason ? *reason : 0, byap);
 
-	authstate = AS_IDLE;
+	ifc->authstate = AS_IDLE;
 
 	handle_disconnect();
 }
@@ -436,12 +1121,12 @@ void upload_ptk(void)
 	struct nlattr* at;
 
 	nl_new_cmd(&nl, nl80211, NL80211_CMD_NEW_KEY, 0);
-	nl_put_u32(&nl, NL80211_ATTR_IFINDEX, ifindex);
-	nl_put(&nl, NL80211_ATTR_MAC, ap.bssid, sizeof(ap.bssid));
+	nl_put_u32(&nl, NL80211_ATTR_IFINDEX, ifc->ifindex);
+	nl_put(&nl, NL80211_ATTR_MAC, ifc->ap.bssid, sizeof(ifc->ap.bssid));
 
 	nl_put_u8(&nl, NL80211_ATTR_KEY_IDX, 0);
 	nl_put_u32(&nl, NL80211_ATTR_KEY_CIPHER, ccmp);
-	nl_put(&nl, NL80211_ATTR_KEY_DATA, PTK, 16);
+	nl_put(&nl, NL80211_ATTR_KEY_DATA, ifc->PTK, 16);
 	nl_put(&nl, NL80211_ATTR_KEY_SEQ, seq, 6);
 
 	at = nl_put_nest(&nl, NL80211_ATTR_KEY_DEFAULT_TYPES);
@@ -458,17 +1143,17 @@ void upload_gtk(void)
 	struct nlattr* at;
 
 	nl_new_cmd(&nl, nl80211, NL80211_CMD_NEW_KEY, 0);
-	nl_put_u32(&nl, NL80211_ATTR_IFINDEX, ifindex);
+	nl_put_u32(&nl, NL80211_ATTR_IFINDEX, ifc->ifindex);
 
-	nl_put_u8(&nl, NL80211_ATTR_KEY_IDX, gtkindex);
-	nl_put(&nl, NL80211_ATTR_KEY_SEQ, RSC, 6);
+	nl_put_u8(&nl, NL80211_ATTR_KEY_IDX, ifc->gtkindex);
+	nl_put(&nl, NL80211_ATTR_KEY_SEQ, ifc->RSC, 6);
 
-	if(ap.tkipgroup) {
+	if(ifc->ap.tkipgroup) {
 		nl_put_u32(&nl, NL80211_ATTR_KEY_CIPHER, tkip);
-		nl_put(&nl, NL80211_ATTR_KEY_DATA, GTK, 32);
+		nl_put(&nl, NL80211_ATTR_KEY_DATA, ifc->GTK, 32);
 	} else {
 		nl_put_u32(&nl, NL80211_ATTR_KEY_CIPHER, ccmp);
-		nl_put(&nl, NL80211_ATTR_KEY_DATA, GTK, 16);
+		nl_put(&nl, NL80211_ATTR_KEY_DATA, ifc->GTK, 16);
 	}
 
 	at = nl_put_nest(&nl, NL80211_ATTR_KEY_DEFAULT_TYPES);
@@ -486,34 +1171,99 @@ void upload_gtk(void)
    losing a connection. In both cases the configured AP should be
    tried first before proceeding to reassess_wifi_situation(). */
 
-static void drop_stale_scan_slots(void)
+static void drop_expired_scan_slots(void)
 {
 	struct scan* sc;
+	int now = uptime();
 
-	for(sc = scans; sc < scans + nscans; sc++)
-		if(sc->flags & SF_STALE)
+	for(sc = ifc->scans; sc < ifc->scans + ifc->nscans; sc++)
+		if(sc->freq && now - sc->seen > SCAN_MAX_AGE)
 			free_scan_slot(sc);
 }
 
+/* Chunked scans go on until either all chunks have been scanned,
+   or there's an AP good enough to try right away. Nothing is left
+   running in the latter case, the remaining chunks just never get
+   triggered. */
+
+static int continue_chunked_scan(void)
+{
+	if(!(ifc->scanreq & SR_SCANNING_CHUNKED))
+		return 0;
+	if(!(ifc->scanreq & SR_SCAN_ALL_CHUNKS) && got_good_enough_ap())
+		return 0;
+	if(trigger_scan(-1) < 0)
+		return 0;
+
+	return 1;
+}
+
+/* Whatever turned up in our scan has already been merged into the lists
+   of the other interfaces, see share_scan(). Those that are not scanning
+   themselves get to look at it right away. A scan of the whole range
+   counts as a fresh scan for them, sparing them the next routine one. */
+
+static void share_scan_results(int current)
+{
+	struct iface* own = ifc;
+	int partial = SR_SCANNING_ONE_FREQ | SR_SCANNING_CHUNKED |
+	              SR_SCANNING_ROAM | SR_HARVESTING | SR_CACHED_ONLY;
+
+	for(ifc = ifaces; ifc < ifaces + nifaces; ifc++) {
+		if(ifc == own || ifc->scanstate != SS_IDLE)
+			continue;
+		if(!(current & partial))
+			ifc->lastscan = uptime();
+
+		check_new_scan_results();
+		handle_shared_scan();
+	}
+
+	ifc = own;
+}
+
+/* A scan requested to connect during the cached-only dump at startup
+   gets folded into it, see start_scan(). The cached results then have
+   to be acted upon the way that request wanted. */
+
 static void genl_done(void)
 {
-	int current = scanreq;
+	int current = ifc->scanreq;
+	int queued = ifc->scanqueue;
+	int connect = SR_RECONNECT_CURRENT | SR_CONNECT_SOMETHING;
 
-	if(scanstate != SS_SCANDUMP)
+	if(ifc->scanstate == SS_SURVEYDUMP)
+		return trigger_scan_dump();
+	if(ifc->scanstate != SS_SCANDUMP)
 		return;
 
-	reset_scan_state();
-
-	drop_stale_scan_slots();
+	drop_expired_scan_slots();
 
 	check_new_scan_results();
+	share_scan_results(current);
+
+	if(continue_chunked_scan())
+		return;
+
+	reset_scan_state();
+
+	if((current & SR_CACHED_ONLY) && !(current & connect))
+		return handle_cached_scan();
+	if(!(current & SR_CACHED_ONLY))
+		ifc->lastscan = uptime();
 
 	report_scan_done();
 
-	if(current & SR_RECONNECT_CURRENT)
-		return reconnect_to_current_ap();
-	if(current & SR_CONNECT_SOMETHING)
-		return reassess_wifi_situation();
+	if(ifc->authstate == AS_CONNECTED)
+		consider_roaming();
+	else if(current & SR_RECONNECT_CURRENT)
+		reconnect_to_current_ap();
+	else if(current & SR_CONNECT_SOMETHING)
+		reassess_wifi_situation();
+	else if(current & SR_HARVESTING)
+		handle_harvested_scan();
+
+	start_queued_scans(queued);
 }
 
 /* Netlink errors caused by scan-related commands; we track those
@@ -522,20 +1272,42 @@ static void genl_done(void)
 
 static void handle_scan_error(int err)
 {
+	int queued = ifc->scanqueue;
+
 	if(!err) return; /* stray ACK */
 
+	if(ifc->scanstate == SS_SURVEYDUMP) {
+		ifc->nosurvey = 1;
+		return trigger_scan_dump();
+	}
+
 	reset_scan_state();
 	report_scan_fail();
+	start_queued_scans(queued);
+}
+
+/* The helper interface going down must not be mistaken for our own,
+   and there is no point in trying it again. Scans fall back to the data
+   radio then. */
+
+static void handle_helper_error(int err)
+{
+	if(err == -ENETDOWN || err == -ENODEV) {
+		warn("scan interface unusable\n");
+		ifc->scanifi = 0;
+	}
+
+	handle_scan_error(err);
 }
 
 static void snap_to_netdown(void)
 {
 	reset_scan_state();
 
-	if(rfkilled) {
-		authstate = AS_IDLE;
+	if(ifc->rfkilled) {
+		ifc->authstate = AS_IDLE;
 	} else {
-		authstate = AS_NETDOWN;
+		ifc->authstate = AS_NETDOWN;
 		set_timer(1);
 	}
 
@@ -557,12 +1329,11 @@ static void snap_to_netdown(void)
 
 static void handle_auth_error(int err)
 {
-	if(authstate == AS_DISCONNECTING) {
-		authstate = AS_IDLE;
+	if(ifc->authstate == AS_DISCONNECTING) {
+		ifc->authstate = AS_IDLE;
 		reassess_wifi_situation();
-	} else if(authstate == AS_AUTHENTICATING && err == -ENOENT) {
-		authstate = AS_IDLE;
-		start_scan(ap.freq);
+	} else if(ifc->authstate == AS_AUTHENTICATING && err == -ENOENT) {
+		rescan_current_freq();
 	} else {
 		abort_connection();
 	}
@@ -570,11 +1341,21 @@ static void handle_auth_error(int err)
 
 static void genl_error(struct nlerr* msg)
 {
-	if(msg->err == -ENETDOWN)
+	int helper = ifc->scanifi && ifc->scanon == ifc->scanifi;
+
+	if(msg->nlm.seq == ifc->scanseq && helper)
+		handle_helper_error(msg->err);
+	else if(msg->err == -ENETDOWN)
 		snap_to_netdown();
-	else if(msg->nlm.seq == scanseq)
+	else if(msg->nlm.seq == ifc->scanseq)
 		handle_scan_error(msg->err);
-	else if(authstate != AS_IDLE)
+	else if(msg->nlm.seq == ifc->cqmseq)
+		; /* CQM not supported */
+	else if(msg->nlm.seq == ifc->frameseq)
+		; /* action frame not sent */
+	else if(msg->nlm.seq == ifc->rekeyseq)
+		ifc->norekey = 1;
+	else if(ifc->authstate != AS_IDLE)
 		handle_auth_error(msg->err);
 }
 
@@ -585,10 +1366,16 @@ static const struct cmd {
 	{ NL80211_CMD_TRIGGER_SCAN,     cmd_trigger_scan }, /* scan */
 	{ NL80211_CMD_NEW_SCAN_RESULTS, cmd_scan_results },
 	{ NL80211_CMD_SCAN_ABORTED,     cmd_scan_aborted },
+	{ NL80211_CMD_NEW_SURVEY_RESULTS, cmd_survey_results },
 	{ NL80211_CMD_AUTHENTICATE,     cmd_authenticate }, /* mlme */
 	{ NL80211_CMD_ASSOCIATE,        cmd_associate    },
 	{ NL80211_CMD_CONNECT,          cmd_connect      },
-	{ NL80211_CMD_DISCONNECT,       cmd_disconnect   }
+	{ NL80211_CMD_DISCONNECT,       cmd_disconnect   },
+	{ NL80211_CMD_NOTIFY_CQM,       cmd_notify_cqm   },
+	{ NL80211_CMD_CH_SWITCH_STARTED_NOTIFY, cmd_ch_switch },
+	{ NL80211_CMD_CH_SWITCH_NOTIFY, cmd_ch_switch    },
+	{ NL80211_CMD_FRAME,            cmd_frame        },
+	{ NL80211_CMD_SET_REKEY_OFFLOAD, cmd_rekey_offload }
 };
 
 static void dispatch(struct nlgen* msg)
@@ -602,18 +1389,53 @@ static void dispatch(struct nlgen* msg)
 
 /* Netlink has no notion of per-device subscription.
    We will be getting notifications for all available nl80211 devices,
-   not just the one we watch. */
+   not just the ones we manage. Most of them get dropped by the socket
+   filter, see setup_nlfilter(), but not necessary all.
 
-static int match_ifi(struct nlgen* msg)
+   Notifications get routed by ifindex. Only scan-related messages
+   are of interest for the scan helpers. Everything else is a reply
+   to some request of ours, and goes wherever the request came from. */
+
+static int scan_related(int cmd)
 {
-	int32_t* ifi;
+	switch(cmd) {
+		case NL80211_CMD_TRIGGER_SCAN:
+		case NL80211_CMD_NEW_SCAN_RESULTS:
+		case NL80211_CMD_SCAN_ABORTED:
+		case NL80211_CMD_NEW_SURVEY_RESULTS:
+			return 1;
+	}
 
-	if(!(ifi = nl_get_i32(msg, NL80211_ATTR_IFINDEX)))
-		return 0;
-	if(*ifi != ifindex)
-		return 0;
+	return 0;
+}
 
-	return 1;
+static struct iface* match_ifi(struct nlgen* msg)
+{
+	struct iface* fi;
+	int ifi = msg_ifi(msg);
+
+	if(!ifi)
+		return NULL;
+
+	for(fi = ifaces; fi < ifaces + nifaces; fi++)
+		if(fi->ifindex == ifi)
+			return fi;
+		else if(fi->scanifi == ifi && scan_related(msg->cmd))
+			return fi;
+
+	return NULL;
+}
+
+static struct iface* msg_owner(struct nlmsg* msg)
+{
+	struct nlgen* gen;
+
+	if(msg->seq)
+		return request_owner(msg->seq);
+	if(!(gen = nl_gen(msg)))
+		return NULL;
+
+	return match_ifi(gen);
 }
 
 void handle_netlink(void)
@@ -626,19 +1448,183 @@ void handle_netlink(void)
 		quit("nl-recv: %m\n");
 
 	while((msg = nl_get_nowait(&nl)))
-		if(msg->type == NLMSG_DONE)
+		if(!(ifc = msg_owner(msg)))
+			;
+		else if(ifc->opermode == OP_EXIT)
+			;
+		else if(msg->type == NLMSG_DONE)
 			genl_done();
 		else if((err = nl_err(msg)))
 			genl_error(err);
-		else if(!(gen = nl_gen(msg)))
-			;
-		else if(!match_ifi(gen))
-			;
-		else dispatch(gen);
+		else if((gen = nl_gen(msg)))
+			dispatch(gen);
 
 	nl_shift_rxbuf(&nl);
 }
 
+/* Wake-up triggers for suspend, most important first. Drivers reject
+   the whole set if any of them is unsupported, so the list gets cut
+   short until it goes through. Unlike the frame registrations, the setting
+   belongs to the wiphy and outlives the socket, so it gets cleared
+   on regular exit, but left in place for a hitless restart. */
+
+static const int wowtrigs[] = {
+	NL80211_WOWLAN_TRIG_DISCONNECT,
+	NL80211_WOWLAN_TRIG_GTK_REKEY_FAILURE,
+	NL80211_WOWLAN_TRIG_MAGIC_PKT
+};
+
+static int set_wowlan(int n)
+{
+	struct nlattr* at;
+	int i;
+
+	nl_new_cmd(&nl, nl80211, NL80211_CMD_SET_WOWLAN, 0);
+	nl_put_u32(&nl, NL80211_ATTR_IFINDEX, ifc->ifindex);
+
+	at = nl_put_nest(&nl, NL80211_ATTR_WOWLAN_TRIGGERS);
+	for(i = 0; i < n; i++)
+		nl_put_empty(&nl, wowtrigs[i]);
+	nl_end_nest(&nl, at);
+
+	return nl_send_recv_ack(&nl);
+}
+
+void setup_wowlan(void)
+{
+	int n, ret;
+
+	for(n = ARRAY_SIZE(wowtrigs); n > 0; n--)
+		if((ret = set_wowlan(n)) >= 0 || ret == -EOPNOTSUPP)
+			break;
+}
+
+void clear_wowlan(void)
+{
+	nl_new_cmd(&nl, nl80211, NL80211_CMD_SET_WOWLAN, 0);
+	nl_put_u32(&nl, NL80211_ATTR_IFINDEX, ifc->ifindex);
+
+	nl_send_recv_ack(&nl);
+}
+
+/* Notifications for the devices we do not manage would wake us up
+   only to get dropped in match_ifi(). A socket filter drops them in
+   the kernel instead, so that wsupp only wakes up for its own
+   interfaces and their scan helpers.
+
+   Classic BPF cannot walk attributes, so the filter only checks the two
+   leading ones. This covers all notifications we care about, nl80211
+   puts WIPHY and then IFINDEX first, or just IFINDEX. Anything else gets
+   through and is handled by match_ifi() as before. So do replies to our
+   own requests, which are the only messages with non-zero seq.
+
+   BPF loads are big-endian, hence the ntohl() for the constants. */
+
+struct sockfilter {
+	uint16_t code;
+	uint8_t jt;
+	uint8_t jf;
+	uint32_t k;
+};
+
+struct sockfprog {
+	ushort len;
+	struct sockfilter* filter;
+};
+
+#define LD_ABS_W   0x20 /* BPF_LD  | BPF_W   | BPF_ABS */
+#define JMP_JA     0x05 /* BPF_JMP | BPF_JA */
+#define JMP_JEQ_K  0x15 /* BPF_JMP | BPF_JEQ | BPF_K */
+#define RET_K      0x06 /* BPF_RET | BPF_K */
+
+#define ATTR0 (sizeof(struct nlgen))
+#define ATTR1 (ATTR0 + 8)
+
+static int filter_ifis(uint32_t* ifis)
+{
+	struct iface* fi;
+	int n = 0;
+
+	for(fi = ifaces; fi < ifaces + nifaces; fi++) {
+		ifis[n++] = ntohl(fi->ifindex);
+
+		if(fi->scanifi)
+			ifis[n++] = ntohl(fi->scanifi);
+	}
+
+	return n;
+}
+
+void setup_nlfilter(void)
+{
+	struct nlattr hdr = { .len = 8, .type = NL80211_ATTR_IFINDEX };
+	struct sockfilter code[11 + 2*NIFACES];
+	uint32_t ifis[2*NIFACES], ifh;
+	int i, n = filter_ifis(ifis);
+	int acc = 10 + n; /* index of the accept insn */
+
+	memcpy(&ifh, &hdr, 4);
+	ifh = ntohl(ifh);
+
+	struct sockfilter head[] = {
+		{ LD_ABS_W,  0, 0, offsetof(struct nlmsg, seq) },
+		{ JMP_JEQ_K, 0, acc - 2, 0 },    /* reply -> accept */
+		{ LD_ABS_W,  0, 0, ATTR0 },
+		{ JMP_JEQ_K, 2, 0, ifh },
+		{ LD_ABS_W,  0, 0, ATTR1 },
+		{ JMP_JEQ_K, 2, acc - 6, ifh },  /* neither -> accept */
+		{ LD_ABS_W,  0, 0, ATTR0 + 4 },
+		{ JMP_JA,    0, 0, 1 },
+		{ LD_ABS_W,  0, 0, ATTR1 + 4 }
+	};
+	struct sockfilter tail[] = {
+		{ RET_K, 0, 0, 0 },             /* drop */
+		{ RET_K, 0, 0, 0xFFFFFFFF }     /* accept */
+	};
+	struct sockfprog prog = {
+		.len = ARRAY_SIZE(head) + n + ARRAY_SIZE(tail),
+		.filter = code
+	};
+
+	memcpy(code, head, sizeof(head));
+
+	for(i = 0; i < n; i++) {
+		struct sockfilter* sf = &code[ARRAY_SIZE(head) + i];
+
+		sf->code = JMP_JEQ_K;
+		sf->jt = acc - (ARRAY_SIZE(head) + i + 1);
+		sf->jf = 0;
+		sf->k = ifis[i];
+	}
+
+	memcpy(code + ARRAY_SIZE(head) + n, tail, sizeof(tail));
+
+	if(setsockopt(netlink, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0)
+		warn("SO_ATTACH_FILTER: %m\n");
+}
+
+/* Optional second radio for scanning, see scan_iface(). It only needs
+   to be up, wsupp does not use it for anything else. */
+
+void setup_scan_iface(char* name)
+{
+	uint nlen = strlen(name);
+	struct ifreq ifr;
+
+	if(nlen > sizeof(ifr.ifr_name))
+		fail("name too long: %s\n", name);
+
+	memzero(&ifr, sizeof(ifr));
+	memcpy(ifr.ifr_name, name, nlen);
+
+	if(ioctl(netlink, SIOCGIFINDEX, &ifr) < 0)
+		fail("ioctl SIOCGIFINDEX %s: %m\n", name);
+	if(ifr.ifr_ifindex == ifc->ifindex)
+		return;
+
+	ifc->scanifi = ifr.ifr_ifindex;
+}
+
 void setup_netlink(void)
 {
 	char* family = "nl80211";
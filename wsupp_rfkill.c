@@ -1,5 +1,6 @@
 #include <stdint.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -37,8 +38,6 @@
    connection. */
 
 int rfkill;
-int rfkilled;
-static int rfkidx;
 
 /* The interface gets brought up with simple ioctls. It could have been done
    with RTNL as well, but setting up RTNL for this mere reason hardly makes
@@ -50,30 +49,31 @@ static int rfkidx;
 
 //#define IFF_UP (1<<0)
 
-static void bring_iface_up(void)
+static int bring_iface_up(void)
 {
 	int fd = netlink;
-	char* name = ifname;
+	char* name = ifc->ifname;
 	uint nlen = strlen(name);
 	struct ifreq ifr;
 	int ret;
 
-	if(nlen > sizeof(ifr.ifr_name))
-		quit("iface name too long: %s\n", name);
+	if(nlen > sizeof(ifr.ifr_name)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
 
 	memzero(&ifr, sizeof(ifr));
 	memcpy(ifr.ifr_name, name, nlen);
 
 	if((ret = ioctl(fd, SIOCGIFFLAGS, &ifr)) < 0)
-		quit("ioctl SIOCGIFFLAGS %s: %m\n", name);
+		return ret;
 
 	if(ifr.ifr_flags & IFF_UP)
-		return;
+		return 0;
 
 	ifr.ifr_flags |= IFF_UP;
 
-	if((ret = ioctl(fd, SIOCSIFFLAGS, &ifr)) < 0)
-		quit("ioctl SIOCSIFFLAGS %s: %m\n", name);
+	return ioctl(fd, SIOCSIFFLAGS, &ifr);
 }
 
 static int match_rfkill(int idx)
@@ -83,40 +83,54 @@ static int match_rfkill(int idx)
 	char path[plen];
 
 	snprintf(path, plen, "/sys/class/net/%s/phy80211/rfkill%i",
-			ifname, idx);
+			ifc->ifname, idx);
 
 	return (stat(path, &st) >= 0);
 }
 
-static void handle_event(struct rfkill_event* re)
+static void check_event(struct rfkill_event* re)
 {
-	if(rfkidx < 0) {
+	if(ifc->rfkidx < 0) {
 		if(match_rfkill(re->idx))
-			rfkidx = re->idx;
+			ifc->rfkidx = re->idx;
 		else
 			return;
-	} else if(re->idx != rfkidx) {
+	} else if(re->idx != ifc->rfkidx) {
 		return;
 	}
 
 	if(re->soft || re->hard) {
-		rfkilled = 1;
+		ifc->rfkilled = 1;
 		clr_timer();
 	} else {
-		rfkilled = 0;
-		bring_iface_up();
-		handle_rfrestored();
+		ifc->rfkilled = 0;
+
+		if(bring_iface_up() < 0)
+			drop_iface("cannot bring the link up: %m\n");
+		else
+			handle_rfrestored();
 	}
 }
 
+static void handle_event(struct rfkill_event* re)
+{
+	for(ifc = ifaces; ifc < ifaces + nifaces; ifc++)
+		if(ifc->opermode != OP_EXIT)
+			check_event(re);
+}
+
 void retry_rfkill(void)
 {
+	struct iface* fi;
+
 	if(rfkill > 0)
 		return;
 
 	rfkill = open("/dev/rfkill", O_RDONLY | O_NONBLOCK);
 
-	rfkidx = -1;
+	for(fi = ifaces; fi < ifaces + nifaces; fi++)
+		fi->rfkidx = -1;
+
 	pollset = 0;
 }
 
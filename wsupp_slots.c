@@ -1,12 +1,29 @@
+#define _GNU_SOURCE
+#include <sys/mman.h>
 #include <string.h>
 
 #include "common.h"
 #include "wsupp.h"
 
+/* Scan slots are kept in an mmaped block that grows a page at a time
+   as more APs get seen, up to NSCANS entries. The address range for
+   all NSCANS gets reserved upfront and pages are only made accessible
+   as needed, so the block never moves and struct scan pointers held
+   across a grab_scan_slot() call remain valid. Busy places may have
+   hundreds of BSSIDs in range, and each dump goes through all of them,
+   so lookups by BSSID go through an open-addressed hash index instead
+   of a linear search. Slots freed in the middle of the array get reused
+   via the free list; the array itself never shrinks, scans[] loops skip
+   empty (freq == 0) slots anyway.
+
+   Once the table is full, the entry that has not been seen for longest
+   gets evicted, with stronger APs getting some extra time. */
+
+#define PAGE 4096
+#define SCANSPACE ((NSCANS*sizeof(struct scan) + PAGE - 1) & ~(PAGE - 1))
+
 struct conn conns[NCONNS];
-struct scan scans[NSCANS];
 int nconns;
-int nscans;
 
 static void* grab_slot(void* slots, int* count, int total, int size)
 {
@@ -50,47 +67,373 @@ void free_conn_slot(struct conn* cn)
 	free_slot(conns, &nconns, sizeof(*cn), cn);
 }
 
-struct scan* find_scan_slot(byte bssid[6])
+/* FNV-1a; the leading bytes are the vendor OUI and tend to repeat,
+   but all six get mixed in anyway. */
+
+static uint hash_bssid(byte bssid[6])
+{
+	uint h = 2166136261U;
+	int i;
+
+	for(i = 0; i < 6; i++)
+		h = (h ^ bssid[i]) * 16777619U;
+
+	return h & (HASHSIZE - 1);
+}
+
+static int locate_scan(byte bssid[6])
+{
+	uint i = hash_bssid(bssid);
+	int idx;
+
+	while((idx = ifc->scanhash[i])) {
+		if(!memcmp(ifc->scans[idx-1].bssid, bssid, 6))
+			return i;
+		i = (i + 1) & (HASHSIZE - 1);
+	}
+
+	return i;
+}
+
+static void index_scan(struct scan* sc)
+{
+	ifc->scanhash[locate_scan(sc->bssid)] = sc - ifc->scans + 1;
+}
+
+/* Backward-shift deletion, so that probe chains remain intact
+   without any tombstones. */
+
+static void unindex_scan(struct scan* sc)
+{
+	uint i = locate_scan(sc->bssid);
+	uint j = i, h;
+	int idx;
+
+	if(!ifc->scanhash[i])
+		return;
+
+	while(1) {
+		j = (j + 1) & (HASHSIZE - 1);
+
+		if(!(idx = ifc->scanhash[j]))
+			break;
+
+		h = hash_bssid(ifc->scans[idx-1].bssid);
+
+		if(((j - h) & (HASHSIZE - 1)) < ((j - i) & (HASHSIZE - 1)))
+			continue;
+
+		ifc->scanhash[i] = idx;
+		i = j;
+	}
+
+	ifc->scanhash[i] = 0;
+}
+
+static int reserve_scans(void)
+{
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+	void* ptr;
+
+	ptr = mmap(NULL, SCANSPACE, PROT_NONE, flags, -1, 0);
+
+	if(ptr == MAP_FAILED)
+		return -1;
+
+	ifc->scans = ptr;
+
+	return 0;
+}
+
+static int extend_scans(void)
+{
+	int prot = PROT_READ | PROT_WRITE;
+	int newsize = ifc->scansize + PAGE;
+	void* ptr;
+
+	if(ifc->maxscans >= NSCANS)
+		return -1;
+	if(!ifc->scans && reserve_scans() < 0)
+		return -1;
+
+	ptr = (void*)ifc->scans + ifc->scansize;
+
+	if(mprotect(ptr, PAGE, prot) < 0)
+		return -1;
+
+	ifc->scansize = newsize;
+	ifc->maxscans = newsize / sizeof(struct scan);
+
+	if(ifc->maxscans > NSCANS)
+		ifc->maxscans = NSCANS;
+
+	return 0;
+}
+
+/* Lower score gets evicted first. Signal is in mBm, so -10000 (-100dBm)
+   adds nothing and -5000 (-50dBm) is worth 10 extra seconds of age.
+   The APs we have PSKs for, and the one we are using, only go if there
+   is nothing else left. */
+
+static int keep_score(struct scan* sc)
+{
+	int score = sc->seen + (sc->signal + 10000)/500;
+
+	if(esses[sc->ess].flags & EF_PASS)
+		score += 24*60*60;
+	if(!memcmp(sc->bssid, ifc->ap.bssid, 6))
+		score += 24*60*60;
+
+	return score;
+}
+
+static void evict_scan_slot(void)
 {
 	struct scan* sc;
+	struct scan* victim = NULL;
+	int score, lowest = 0;
 
-	for(sc = scans; sc < scans + nscans; sc++)
+	for(sc = ifc->scans; sc < ifc->scans + ifc->nscans; sc++) {
 		if(!sc->freq)
 			continue;
-		else if(!memcmp(sc->bssid, bssid, 6))
-			return sc;
+
+		score = keep_score(sc);
+
+		if(victim && score >= lowest)
+			continue;
+
+		victim = sc;
+		lowest = score;
+	}
+
+	if(victim)
+		free_scan_slot(victim);
+}
+
+static struct scan* take_free_slot(void)
+{
+	if(!ifc->nfree && ifc->nscans >= ifc->maxscans && extend_scans() < 0)
+		evict_scan_slot();
+
+	if(ifc->nfree > 0)
+		return ifc->scans + ifc->freescans[--ifc->nfree];
+	if(ifc->nscans < ifc->maxscans)
+		return ifc->scans + ifc->nscans++;
 
 	return NULL;
 }
 
+struct scan* find_scan_slot(byte bssid[6])
+{
+	int idx;
+
+	if(!ifc->scans)
+		return NULL;
+	if(!(idx = ifc->scanhash[locate_scan(bssid)]))
+		return NULL;
+
+	return ifc->scans + idx - 1;
+}
+
 struct scan* grab_scan_slot(byte bssid[6])
 {
 	struct scan* sc;
 
 	if((sc = find_scan_slot(bssid)))
 		return sc;
-	if((sc = grab_slot(scans, &nscans, NSCANS, sizeof(*sc))))
-		return sc;
+	if(!(sc = take_free_slot()))
+		return NULL;
+
+	memzero(sc, sizeof(*sc));
+	memcpy(sc->bssid, bssid, 6);
+	index_scan(sc);
+
+	return sc;
+}
+
+void free_scan_slot(struct scan* sc)
+{
+	if(!sc->freq)
+		return;
+
+	unindex_scan(sc);
+	unrank_scan(sc);
+	drop_ess(sc->ess);
+	memzero(sc, sizeof(*sc));
+
+	if(ifc->nfree < NSCANS)
+		ifc->freescans[ifc->nfree++] = sc - ifc->scans;
+}
+
+/* With several interfaces managed, whatever one of them finds goes into
+   the scan lists of the others as well, if they can use the channel.
+   Flags stay per interface, being about the connection attempts made
+   there. So does the entry for the AP an interface is connected to,
+   its signal only means something as seen by that interface's radio. */
+
+static void copy_scan(struct scan* sn, struct scan* sc)
+{
+	int flags = sn->flags;
+
+	if(sc->ess)
+		esses[sc->ess].refs++;
+
+	drop_ess(sn->ess);
+	unrank_scan(sn);
+
+	*sn = *sc;
+	sn->flags = flags | SF_DIRTY;
+}
 
-	/* With no more empty slots left, try to sacrifice some
-	   useless ones, namely low-signal ones we don't have PSKs for. */
+static int connected_to(struct scan* sc)
+{
+	if(ifc->authstate != AS_CONNECTED)
+		return 0;
 
-	for(sc = scans; sc < scans + nscans; sc++) {
-		if(sc->signal > -8000) /* -80dBm */
+	return !memcmp(sc->bssid, ifc->ap.bssid, 6);
+}
+
+void share_scan(struct scan* sc)
+{
+	struct iface* own = ifc;
+	struct scan* sn;
+
+	for(ifc = ifaces; ifc < ifaces + nifaces; ifc++) {
+		if(ifc == own || connected_to(sc))
 			continue;
-		if(!(sc->flags & SF_STALE))
+		if(!chan_usable(sc->freq))
 			continue;
-		if(sc->flags & SF_PASS)
+		if((sn = grab_scan_slot(sc->bssid)))
+			copy_scan(sn, sc);
+	}
+
+	ifc = own;
+}
+
+/* Scan entries sharing the same SSID are grouped into ESS records,
+   which is where the stuff that depends on SSID only gets stored,
+   so that it is not repeated for every AP of a multi-AP network.
+   Records are refcounted by the scan entries and struct ap pointing
+   to them. Slot 0 is a permanent empty SSID, for hidden networks and
+   APs with no SSID IE.
+
+   Every parsed BSS looks its SSID up here, for each interface, so the
+   lookups go through a hash index same as the scan slots. */
+
+struct ess esses[NESSES];
+int nesses = 1;
+
+static ushort esshash[ESSHASH];
+
+static uint hash_ssid(byte* ssid, int slen)
+{
+	uint h = 2166136261U;
+	int i;
+
+	for(i = 0; i < slen; i++)
+		h = (h ^ ssid[i]) * 16777619U;
+
+	return h & (ESSHASH - 1);
+}
+
+static int locate_ess(byte* ssid, int slen)
+{
+	uint i = hash_ssid(ssid, slen);
+	struct ess* es;
+	int id;
+
+	while((id = esshash[i])) {
+		es = &esses[id];
+
+		if(es->slen == slen && !memcmp(es->ssid, ssid, slen))
+			return i;
+
+		i = (i + 1) & (ESSHASH - 1);
+	}
+
+	return i;
+}
+
+static void unindex_ess(struct ess* es)
+{
+	uint i = locate_ess(es->ssid, es->slen);
+	uint j = i, h;
+	int id;
+
+	if(!esshash[i])
+		return;
+
+	while(1) {
+		j = (j + 1) & (ESSHASH - 1);
+
+		if(!(id = esshash[j]))
+			break;
+
+		h = hash_ssid(esses[id].ssid, esses[id].slen);
+
+		if(((j - h) & (ESSHASH - 1)) < ((j - i) & (ESSHASH - 1)))
 			continue;
 
-		memzero(sc, sizeof(*sc));
-		return sc;
+		esshash[i] = id;
+		i = j;
 	}
 
-	return NULL;
+	esshash[i] = 0;
 }
 
-void free_scan_slot(struct scan* sc)
+int find_ess(byte* ssid, int slen)
+{
+	if(slen <= 0 || slen > SSIDLEN)
+		return 0;
+
+	return esshash[locate_ess(ssid, slen)];
+}
+
+int grab_ess(byte* ssid, int slen)
+{
+	struct ess* es;
+	int id;
+
+	if(slen > SSIDLEN)
+		slen = SSIDLEN;
+	if(slen <= 0)
+		return 0;
+
+	if((id = find_ess(ssid, slen)))
+		goto ref;
+
+	for(es = esses + 1; es < esses + nesses; es++)
+		if(!es->refs)
+			break;
+	if(es >= esses + NESSES)
+		return 0;
+	if(es >= esses + nesses)
+		nesses++;
+
+	memzero(es, sizeof(*es));
+	memcpy(es->ssid, ssid, slen);
+	es->slen = slen;
+
+	id = es - esses;
+	esshash[locate_ess(ssid, slen)] = id;
+ref:
+	esses[id].refs++;
+
+	return id;
+}
+
+void drop_ess(int id)
 {
-	free_slot(scans, &nscans, sizeof(*sc), sc);
+	struct ess* es = &esses[id];
+
+	if(id <= 0 || id >= nesses)
+		return;
+	if(--es->refs > 0)
+		return;
+
+	unindex_ess(es);
+	memzero(es, sizeof(*es));
+
+	while(nesses > 1 && !esses[nesses-1].refs)
+		nesses--;
 }
@@ -91,23 +91,219 @@ static void parse_vendor(struct scan* sc, int len, char* buf)
 		sc->type |= ST_WPS;
 }
 
+/* Reduced Neighbor Report lists APs colocated with this one, which is
+   how 6GHz APs are supposed to be discovered. Only the channels are of
+   any interest here, see wsupp_chans.c.
+
+   Ref. IEEE 802.11ax-2021 9.4.2.170 Reduced Neighbor Report element
+                           Table E-4 Global operating classes */
+
+static int rnr_freq(int opclass, int chan)
+{
+	if(opclass < 131 || opclass > 137)
+		return 0; /* not 6GHz */
+	if(opclass == 136)
+		return 5925 + 5*chan;
+
+	return 5950 + 5*chan;
+}
+
+static void parse_rnr(int len, char* buf)
+{
+	char* p = buf;
+	char* e = buf + len;
+	int freq;
+
+	while(p + 4 <= e) {
+		int count = ((p[0] >> 4) & 0x0F) + 1;
+		int size = p[1] & 0xFF;
+		int opclass = p[2] & 0xFF;
+		int chan = p[3] & 0xFF;
+
+		p += 4 + count*size;
+
+		if(p > e)
+			break;
+		if((freq = rnr_freq(opclass, chan)))
+			mark_rnr_channel(freq);
+	}
+}
+
+/* PHY capabilities, for estimating throughput in wsupp_apsel.c.
+   What matters is the PHY generation, the channel width, and the number
+   of spatial streams the AP can receive, along with the channel load
+   the AP reports.
+
+   Ref. IEEE 802.11-2020 9.4.2.27 BSS Load element
+                         9.4.2.55 HT Capabilities element
+                         9.4.2.56 HT Operation element
+                         9.4.2.157 VHT Capabilities element
+                         9.4.2.158 VHT Operation element
+        IEEE 802.11ax-2021 9.4.2.248 HE Capabilities element
+                           9.4.2.249 HE Operation element */
+
+static void set_phy(struct scan* sc, int phy, int nss)
+{
+	if(sc->phy < phy)
+		sc->phy = phy;
+	if(sc->nss < nss)
+		sc->nss = nss;
+}
+
+static void set_width(struct scan* sc, int bw)
+{
+	if(sc->bw < bw)
+		sc->bw = bw;
+}
+
+/* VHT and HE MCS maps use 2 bits per stream, 3 meaning not supported */
+
+static int mcs_map_nss(int map)
+{
+	int i, nss = 0;
+
+	for(i = 0; i < 8; i++)
+		if(((map >> 2*i) & 3) != 3)
+			nss = i + 1;
+
+	return nss;
+}
+
+static void parse_bss_load(struct scan* sc, int len, char* buf)
+{
+	if(len < 5)
+		return;
+
+	sc->load = buf[2] & 0xFF;
+}
+
+static void parse_ht_cap(struct scan* sc, int len, char* buf)
+{
+	int i, nss = 0;
+
+	if(len < 26)
+		return;
+
+	for(i = 0; i < 4; i++)
+		if(buf[3+i])
+			nss = i + 1;
+
+	set_phy(sc, PHY_HT, nss);
+}
+
+static void parse_ht_op(struct scan* sc, int len, char* buf)
+{
+	if(len < 22)
+		return;
+	if(!(buf[1] & 0x03)) /* secondary channel offset */
+		return;
+	if(!(buf[1] & 0x04)) /* STA channel width */
+		return;
+
+	set_width(sc, BW_40);
+}
+
+static void parse_vht_cap(struct scan* sc, int len, char* buf)
+{
+	if(len < 12)
+		return;
+
+	set_phy(sc, PHY_VHT, mcs_map_nss(get2le(buf + 4, buf + len)));
+}
+
+static void parse_vht_op(struct scan* sc, int len, char* buf)
+{
+	int ccfs0, ccfs1;
+
+	if(len < 5)
+		return;
+	if(buf[0] != 1) /* 20 or 40MHz, see HT op */
+		return;
+
+	ccfs0 = buf[1] & 0xFF;
+	ccfs1 = buf[2] & 0xFF;
+
+	if(ccfs1 && (ccfs1 - ccfs0 == 8 || ccfs0 - ccfs1 == 8))
+		set_width(sc, BW_160);
+	else
+		set_width(sc, BW_80);
+}
+
+static void parse_he_cap(struct scan* sc, int len, char* buf)
+{
+	if(len < 21)
+		return;
+
+	set_phy(sc, PHY_HE, mcs_map_nss(get2le(buf + 17, buf + len)));
+}
+
+/* 6GHz APs have no HT or VHT operation elements, the width is only
+   given in the 6GHz operation info trailing HE operation. */
+
+static void parse_he_op(struct scan* sc, int len, char* buf)
+{
+	char* p = buf + 6;
+	char* e = buf + len;
+	int params;
+
+	if(len < 6)
+		return;
+
+	params = (buf[0] & 0xFF) | ((buf[1] & 0xFF) << 8) | ((buf[2] & 0xFF) << 16);
+
+	if(params & (1<<14)) /* VHT operation info */
+		p += 3;
+	if(params & (1<<15)) /* max co-hosted BSSID indicator */
+		p += 1;
+	if(!(params & (1<<17))) /* 6GHz operation info */
+		return;
+	if(p + 5 > e)
+		return;
+
+	set_width(sc, p[1] & 0x03);
+}
+
+/* 802.11k support, see wsupp_neigh.c */
+
+static void parse_rm_caps(struct scan* sc, int len, char* buf)
+{
+	if(len < 5)
+		return;
+	if(buf[0] & 0x02)
+		sc->type |= ST_RRM_NEIGHBORS;
+}
+
+static void parse_extension(struct scan* sc, int len, char* buf)
+{
+	if(len < 1)
+		return;
+
+	if(buf[0] == 35)
+		parse_he_cap(sc, len - 1, buf + 1);
+	else if(buf[0] == 36)
+		parse_he_op(sc, len - 1, buf + 1);
+}
+
 static void set_station_ssid(struct scan* sc, uint len, char* buf)
 {
+	struct ess* es = &esses[sc->ess];
 	int i;
 
-	if(len > sizeof(sc->ssid))
-		len = sizeof(sc->ssid);
-
-	memcpy(sc->ssid, buf, len);
+	if(len > SSIDLEN)
+		len = SSIDLEN;
 
 	for(i = len; i > 0; i--)
 		if(buf[i-1])
 			break;
 
-	sc->slen = i;
+	if(es->slen == i && !memcmp(es->ssid, buf, i))
+		return;
+
+	drop_ess(sc->ess);
+	sc->ess = grab_ess((byte*)buf, i);
 }
 
-void parse_station_ies(struct scan* sc, char* buf, uint len)
+static void parse_ies(struct scan* sc, char* buf, uint len)
 {
 	char* end = buf + len;
 	char* ptr = buf;
@@ -120,11 +316,68 @@ void parse_station_ies(struct scan* sc, char* buf, uint len)
 			break;
 		if(ie->type == 0)
 			set_station_ssid(sc, ie->len, ie->payload);
+		else if(ie->type == 11)
+			parse_bss_load(sc, ie->len, ie->payload);
+		else if(ie->type == 45)
+			parse_ht_cap(sc, ie->len, ie->payload);
 		else if(ie->type == 48)
 			parse_rsn_ie(sc, ie->len, ie->payload);
+		else if(ie->type == 61)
+			parse_ht_op(sc, ie->len, ie->payload);
+		else if(ie->type == 70)
+			parse_rm_caps(sc, ie->len, ie->payload);
+		else if(ie->type == 191)
+			parse_vht_cap(sc, ie->len, ie->payload);
+		else if(ie->type == 192)
+			parse_vht_op(sc, ie->len, ie->payload);
+		else if(ie->type == 201)
+			parse_rnr(ie->len, ie->payload);
 		else if(ie->type == 221)
 			parse_vendor(sc, ie->len, ie->payload);
+		else if(ie->type == 255)
+			parse_extension(sc, ie->len, ie->payload);
 
 		ptr += ielen;
 	}
 }
+
+/* Beacon IEs rarely change between scans, but a busy place may have
+   hundreds of them in each dump. Hashing the blob a word at a time
+   is much cheaper than walking it IE by IE, so the decoded parts
+   only get updated if the hash or the length differ from the last
+   time. */
+
+static uint32_t hash_ies(char* buf, uint len)
+{
+	uint32_t h = 2166136261U;
+	uint32_t w;
+	uint i;
+
+	for(i = 0; i + 4 <= len; i += 4) {
+		memcpy(&w, buf + i, 4);
+		h = (h ^ w) * 16777619U;
+		h ^= h >> 15;
+	}
+	for(; i < len; i++)
+		h = (h ^ (uint8_t)buf[i]) * 16777619U;
+
+	return h;
+}
+
+void parse_station_ies(struct scan* sc, char* buf, uint len)
+{
+	uint32_t hash = hash_ies(buf, len);
+
+	if(sc->ielen == len && sc->iehash == hash)
+		return;
+
+	sc->type = 0;
+	sc->phy = PHY_LEGACY;
+	sc->bw = BW_20;
+	sc->nss = 1;
+	sc->load = 0;
+	sc->ielen = len;
+	sc->iehash = hash;
+
+	parse_ies(sc, buf, len);
+}
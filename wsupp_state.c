@@ -0,0 +1,196 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "common.h"
+#include "control.h"
+#include "wsupp.h"
+
+/* Scan list snapshot, so that a restarted wsupp does not have to start
+   from a cold full scan. The file is a header followed by raw struct scan
+   records, and only makes sense to the very same build that wrote it,
+   hence the size check. ESS ids are not stable across restarts, so
+   each record carries its own SSID instead. Scan timestamps are uptime()
+   values which do not survive reboots, so the file stores ages relative
+   to the save time, along with the wall clock time of the save.
+
+   The last AP we were connected to gets saved as well. If it is still
+   around, routine_fg_scan() will probe its frequency first. */
+
+#define STATE_MAGIC 0x31535357 /* "WSS1" */
+#define STATE_MAX_AGE 5*60
+#define STATE_INTERVAL 5*60
+
+struct statehdr {
+	uint32_t magic;
+	uint16_t size;
+	uint16_t count;
+	uint64_t time;
+	byte bssid[6];
+	short freq;
+};
+
+struct staterec {
+	struct scan sc;
+	int age;
+	ushort slen;
+	byte ssid[SSIDLEN];
+};
+
+/* Each interface gets its own set of files, named after it,
+   like /var/wiscans-wlan0. */
+
+void iface_path(char* buf, int size, char* base, char* suffix)
+{
+	snprintf(buf, size, "%s-%s%s", base, ifc->ifname, suffix);
+}
+
+/* Saved files get written into a temporary file first, synced, and
+   then renamed over, so that an untimely crash or power loss cannot
+   leave a truncated one. Without fsync, the rename may hit the disk
+   before the data does. A negative ret means the caller's writes
+   failed, and the temporary file gets dropped. */
+
+int commit_tmp(int fd, char* tmp, char* path, int ret)
+{
+	if(ret >= 0)
+		ret = fsync(fd);
+
+	close(fd);
+
+	if(ret >= 0)
+		ret = rename(tmp, path);
+	if(ret < 0)
+		unlink(tmp);
+
+	return ret;
+}
+
+static void restore_scan(struct staterec* sr, int elapsed)
+{
+	struct scan* sc = &sr->sc;
+	struct scan* sn;
+	int age = sr->age + elapsed;
+
+	if(!sc->freq || age > STATE_MAX_AGE)
+		return;
+	if(!(sn = grab_scan_slot(sc->bssid)))
+		return;
+
+	unrank_scan(sn);
+	drop_ess(sn->ess);
+	*sn = *sc;
+	sn->ess = grab_ess(sr->ssid, sr->slen);
+	sn->seen = uptime() - age;
+	sn->flags &= ~(SF_SEEN | SF_GOOD | SF_STALE);
+}
+
+static void restore_current_ap(struct statehdr* sh)
+{
+	struct scan* sc;
+
+	if(!ifc->ap.fixed)
+		return;
+	if(!(sc = find_scan_slot(sh->bssid)))
+		return;
+	if(!sc->ess || sc->ess != ifc->ap.ess)
+		return;
+
+	memcpy(ifc->ap.bssid, sh->bssid, 6);
+	ifc->ap.freq = sh->freq;
+}
+
+void load_scan_state(void)
+{
+	struct statehdr sh;
+	struct staterec sr;
+	int fd, i, elapsed;
+	uint64_t now = wallclock();
+	char path[PATHLEN];
+
+	iface_path(path, sizeof(path), WISCANS, "");
+
+	if((fd = open(path, O_RDONLY)) < 0)
+		return;
+	if(read(fd, &sh, sizeof(sh)) != sizeof(sh))
+		goto out;
+	if(sh.magic != STATE_MAGIC || sh.size != sizeof(sr))
+		goto out;
+	if(sh.time > now || now - sh.time > STATE_MAX_AGE)
+		goto out;
+
+	elapsed = now - sh.time;
+
+	for(i = 0; i < sh.count; i++)
+		if(read(fd, &sr, sizeof(sr)) != sizeof(sr))
+			break;
+		else
+			restore_scan(&sr, elapsed);
+
+	check_new_scan_results();
+	restore_current_ap(&sh);
+out:
+	close(fd);
+}
+
+void save_scan_state(void)
+{
+	struct statehdr sh;
+	struct staterec sr;
+	struct scan* sc;
+	char path[PATHLEN], tmp[PATHLEN];
+	int fd, ret, now = uptime();
+
+	iface_path(path, sizeof(path), WISCANS, "");
+	iface_path(tmp, sizeof(tmp), WISCANS, ".tmp");
+
+	if((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0)
+		return;
+
+	memzero(&sh, sizeof(sh));
+	sh.magic = STATE_MAGIC;
+	sh.size = sizeof(sr);
+	sh.time = wallclock();
+	memcpy(sh.bssid, ifc->ap.bssid, 6);
+	sh.freq = ifc->ap.freq;
+
+	for(sc = ifc->scans; sc < ifc->scans + ifc->nscans; sc++)
+		if(sc->freq) sh.count++;
+
+	if((ret = writeall(fd, &sh, sizeof(sh))) < 0)
+		goto out;
+
+	for(sc = ifc->scans; sc < ifc->scans + ifc->nscans; sc++) {
+		if(!sc->freq)
+			continue;
+
+		memzero(&sr, sizeof(sr));
+		sr.sc = *sc;
+		sr.age = now - sc->seen;
+		sr.slen = esses[sc->ess].slen;
+		memcpy(sr.ssid, esses[sc->ess].ssid, sr.slen);
+
+		if((ret = writeall(fd, &sr, sizeof(sr))) < 0)
+			goto out;
+	}
+out:
+	if(commit_tmp(fd, tmp, path, ret) < 0)
+		return;
+
+	ifc->savedscan = ifc->lastscan;
+	ifc->savedtime = now;
+}
+
+/* Called from the main loop. Only saves anything if there have been
+   new scans since the last save, and not too often. */
+
+void sync_scan_state(void)
+{
+	if(ifc->lastscan == ifc->savedscan)
+		return;
+	if(uptime() - ifc->savedtime < STATE_INTERVAL)
+		return;
+
+	save_scan_state();
+}